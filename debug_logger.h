@@ -4,8 +4,31 @@
 
 
 
+// Уровень задается при сборке: -DDEBUG_LOGGER_LEVEL=N.
+// 0 - ничего, 1 - сообщения DEBUG_LOG, 2 - еще вход/выход из функций со временем,
+// 3 - еще подробные сообщения DEBUG_LOG_VERBOSE (на каждую лексему, инструкцию, шаг).
+// Выключенные макросы не вычисляют аргументы и не читают часы.
+#ifndef DEBUG_LOGGER_LEVEL
+#define DEBUG_LOGGER_LEVEL 2
+#endif
+
+#if DEBUG_LOGGER_LEVEL >= 2
 #define DEBUG_LOGGER(name, indent)       debug_logger_t debug_logger(indent, name, __FILE__, __FUNCTION__, __LINE__)
+#else
+#define DEBUG_LOGGER(name, indent)       do { } while (false)
+#endif
+
+#if DEBUG_LOGGER_LEVEL >= 1
 #define DEBUG_LOG(name, indent, ...)     debug_logger_t::log(name, indent, __LINE__, __VA_ARGS__)
+#else
+#define DEBUG_LOG(name, indent, ...)     do { } while (false)
+#endif
+
+#if DEBUG_LOGGER_LEVEL >= 3
+#define DEBUG_LOG_VERBOSE(name, indent, ...)  debug_logger_t::log(name, indent, __LINE__, __VA_ARGS__)
+#else
+#define DEBUG_LOG_VERBOSE(name, indent, ...)  do { } while (false)
+#endif
 
 #define LOG_DURATION(time)               log_duration_t(time);
 
@@ -16,17 +39,15 @@ class debug_logger_t {
   debug_logger_t(int& indent, const char* name, const char* file, const char* function, const int line)
       : indent(indent), name(name), file(file), function(function), line(line) {
     fprintf(stderr, "%s %d    %*s#%d --> %s\n", name, indent / 2, indent, "", line, function);
-    fflush(stderr);
     indent += 2;
-    time = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    start = std::chrono::steady_clock::now();
   }
 
   ~debug_logger_t( ) {
     indent -= 2;
 
-    time = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() - time;
+    auto time = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
     fprintf(stderr, "%s %d %c  %*s# <-- %s %ldms\n", name, indent / 2, std::uncaught_exceptions() ? '*' : ' ', indent, "", function, time);
-    fflush(stderr);
   }
 
   static void log(const char* name, int indent, int line, const char* format, ...) {
@@ -37,7 +58,6 @@ class debug_logger_t {
     vfprintf(stderr, format, args);
     va_end(args);
     fprintf(stderr, "\n");
-    fflush(stderr);
   }
 
  private:
@@ -46,7 +66,7 @@ class debug_logger_t {
   const  char* file; // TODO
   const  char* function;
   const  int   line;
-  uint64_t     time;
+  std::chrono::steady_clock::time_point start;
 };
 
 struct log_duration_t {
@@ -1,56 +1,278 @@
 
 #include <iostream>
 #include <variant>
-#include <regex>
 #include <iomanip>
+#include <sstream>
+#include <algorithm>
+#include <numeric>
+#include <array>
+#include <vector>
+#include <map>
+#include <set>
+#include <list>
+#include <unordered_map>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <string>
+#include <string_view>
+#include <charconv>
+#include <span>
+#include <memory>
+#include <fstream>
+#include <bit>
+#include <optional>
+#include <limits>
+#include <exception>
+#include <cstddef>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <deque>
+
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "debug_logger.h"
 
 #define DEBUG_LOGGER_TRACE_LA            DEBUG_LOGGER("la   ", logger_indent_risc_t::indent)
 #define DEBUG_LOGGER_LA(...)             DEBUG_LOG("la   ", logger_indent_risc_t::indent, __VA_ARGS__)
+#define DEBUG_LOGGER_VERBOSE_LA(...)     DEBUG_LOG_VERBOSE("la   ", logger_indent_risc_t::indent, __VA_ARGS__)
 
 #define DEBUG_LOGGER_TRACE_SA            DEBUG_LOGGER("sa   ", logger_indent_risc_t::indent)
 #define DEBUG_LOGGER_SA(...)             DEBUG_LOG("sa   ", logger_indent_risc_t::indent, __VA_ARGS__)
+#define DEBUG_LOGGER_VERBOSE_SA(...)     DEBUG_LOG_VERBOSE("sa   ", logger_indent_risc_t::indent, __VA_ARGS__)
 
 #define DEBUG_LOGGER_TRACE_ICG           DEBUG_LOGGER("icg  ", logger_indent_risc_t::indent)
 #define DEBUG_LOGGER_ICG(...)            DEBUG_LOG("icg  ", logger_indent_risc_t::indent, __VA_ARGS__)
+#define DEBUG_LOGGER_VERBOSE_ICG(...)    DEBUG_LOG_VERBOSE("icg  ", logger_indent_risc_t::indent, __VA_ARGS__)
+
+#define DEBUG_LOGGER_TRACE_OPT           DEBUG_LOGGER("opt  ", logger_indent_risc_t::indent)
+#define DEBUG_LOGGER_OPT(...)            DEBUG_LOG("opt  ", logger_indent_risc_t::indent, __VA_ARGS__)
+#define DEBUG_LOGGER_VERBOSE_OPT(...)    DEBUG_LOG_VERBOSE("opt  ", logger_indent_risc_t::indent, __VA_ARGS__)
 
 #define DEBUG_LOGGER_TRACE_CG            DEBUG_LOGGER("cg   ", logger_indent_risc_t::indent)
 #define DEBUG_LOGGER_CG(...)             DEBUG_LOG("cg   ", logger_indent_risc_t::indent, __VA_ARGS__)
+#define DEBUG_LOGGER_VERBOSE_CG(...)     DEBUG_LOG_VERBOSE("cg   ", logger_indent_risc_t::indent, __VA_ARGS__)
 
 #define DEBUG_LOGGER_TRACE_EXEC          DEBUG_LOGGER("exec ", logger_indent_risc_t::indent)
 #define DEBUG_LOGGER_EXEC(...)           DEBUG_LOG("exec ", logger_indent_risc_t::indent, __VA_ARGS__)
+#define DEBUG_LOGGER_VERBOSE_EXEC(...)   DEBUG_LOG_VERBOSE("exec ", logger_indent_risc_t::indent, __VA_ARGS__)
 
 template <typename T>
-struct logger_indent_t { static inline int indent = 0; };
+struct logger_indent_t { static inline thread_local int indent = 0; };   // свой отступ у каждого потока
 
 struct logger_indent_risc_t : logger_indent_t<logger_indent_risc_t> { };
 
 
-/*
-struct segment_t {
-  uint64_t type;
-  std::deque<uint64_t> data;
-};
-
-struct segment_text_t {
-  std::deque<uint64_t> data;
-};
-
-struct library_file_t {
-  std::deque<segment_t> segments;
-};
-*/
 
 namespace risc_n {
 
   namespace utils_n {
 
     using data_t = std::vector<uint8_t>;
+    using text_t = std::span<const uint8_t>;
 
     struct fatal_error : std::runtime_error {
       fatal_error(const std::string& msg = "unknown error") : std::runtime_error(msg) { }
     };
+
+    // Совершенный хеш имен: seed подбирается при компиляции так, чтобы все
+    // имена таблицы попали в разные слоты. Повтор имени в таблице - ошибка компиляции.
+    constexpr uint32_t name_hash(std::string_view name, uint32_t seed) {
+      uint32_t hash = 2166136261u ^ seed;
+      for (char c : name) {
+        hash ^= static_cast<uint8_t>(c);
+        hash *= 16777619u;
+      }
+      return hash;
+    }
+
+    template <size_t size>
+    struct perfect_hash_t {
+      uint32_t                   seed;
+      std::array<uint8_t, size>  slots;   // индекс в таблице + 1, 0 - пустой слот
+
+      constexpr size_t slot(std::string_view name) const {
+        return name_hash(name, seed) % size;
+      }
+    };
+
+    template <size_t size, typename table_t>
+    constexpr perfect_hash_t<size> make_perfect_hash(const table_t& table) {
+      static_assert(std::tuple_size_v<table_t> < size && size < 256);
+      for (uint32_t seed = 0; seed < 4096; ++seed) {
+        perfect_hash_t<size> hash = { seed, {} };
+        bool collision = false;
+        for (size_t i = 0; i < table.size() && !collision; ++i) {
+          auto& slot = hash.slots[hash.slot(table[i].name)];
+          collision = slot;
+          slot = i + 1;
+        }
+        if (!collision)
+          return hash;
+      }
+      throw fatal_error("perfect hash not found");
+    }
+
+    // Очередь без блокировок для одного писателя и одного читателя.
+    // Емкость - степень двойки, head и tail растут монотонно. Каждая сторона
+    // помнит последнее увиденное значение чужого индекса и перечитывает его,
+    // только когда очередь кажется полной (пустой).
+    template <typename T>
+    class spsc_ring_t {
+     public:
+      explicit spsc_ring_t(size_t capacity) : items(std::bit_ceil(capacity)), mask(items.size() - 1) { }
+
+      bool push(const T& item) {
+        auto tail = this->tail.load(std::memory_order_relaxed);
+        if (tail - head_cached == items.size()) {
+          head_cached = head.load(std::memory_order_acquire);
+          if (tail - head_cached == items.size())
+            return false;
+        }
+        items[tail & mask] = item;
+        this->tail.store(tail + 1, std::memory_order_release);
+        return true;
+      }
+
+      bool pop(T& item) {
+        return pop(&item, 1);
+      }
+
+      // Забирает до count элементов, возвращает число забранных.
+      size_t pop(T* out, size_t count) {
+        auto head = this->head.load(std::memory_order_relaxed);
+        if (head == tail_cached) {
+          tail_cached = tail.load(std::memory_order_acquire);
+          if (head == tail_cached)
+            return 0;
+        }
+        count = std::min(count, tail_cached - head);
+        for (size_t i = 0; i < count; ++i)
+          out[i] = std::move(items[(head + i) & mask]);
+        this->head.store(head + count, std::memory_order_release);
+        return count;
+      }
+
+      bool empty() const {
+        return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+      }
+
+     private:
+      std::vector<T>                   items;
+      size_t                           mask;
+      alignas(64) std::atomic<size_t>  head = 0;
+      size_t                           tail_cached = 0;   // читатель
+      alignas(64) std::atomic<size_t>  tail = 0;
+      size_t                           head_cached = 0;   // писатель
+    };
+
+    // Пул потоков для работы, разбитой по индексам: parallel_for раздает индексы
+    // через общий счетчик, вызывающий поток работает наравне с остальными.
+    // Одновременно выполняется одно задание; первое исключение пробрасывается
+    // вызывающему после завершения всех потоков.
+    class thread_pool_t {
+     public:
+      explicit thread_pool_t(size_t threads = std::thread::hardware_concurrency()) {
+        for (size_t i = 1; i < threads; ++i)
+          workers.emplace_back([this] { work(); });
+      }
+
+      thread_pool_t(const thread_pool_t&) = delete;
+      thread_pool_t& operator=(const thread_pool_t&) = delete;
+
+      ~thread_pool_t() {
+        {
+          std::lock_guard lock(mutex);
+          stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers)
+          worker.join();
+      }
+
+      size_t size() const {
+        return workers.size() + 1;
+      }
+
+      template<typename fn_t>
+      void parallel_for(size_t count, fn_t&& fn) {
+        std::function<void(size_t)> task = std::forward<fn_t>(fn);
+        {
+          std::lock_guard lock(mutex);
+          job    = &task;
+          total  = count;
+          active = workers.size();
+          error  = nullptr;
+          next.store(0, std::memory_order_relaxed);
+          ++generation;
+        }
+        wake.notify_all();
+
+        run();
+
+        std::unique_lock lock(mutex);
+        done.wait(lock, [this] { return !active; });
+        job = nullptr;
+        if (error)
+          std::rethrow_exception(error);
+      }
+
+     private:
+      void work() {
+        uint64_t seen = 0;
+        while (true) {
+          {
+            std::unique_lock lock(mutex);
+            wake.wait(lock, [&] { return stopping || generation != seen; });
+            if (stopping)
+              return;
+            seen = generation;
+          }
+
+          run();
+
+          std::lock_guard lock(mutex);
+          if (!--active)
+            done.notify_all();
+        }
+      }
+
+      void run() {
+        for (size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < total; ) {
+          try {
+            (*job)(i);
+          } catch (...) {
+            std::lock_guard lock(mutex);
+            if (!error)
+              error = std::current_exception();
+            next.store(total, std::memory_order_relaxed);
+          }
+        }
+      }
+
+      std::vector<std::thread>           workers;
+      std::mutex                         mutex;
+      std::condition_variable            wake;
+      std::condition_variable            done;
+      const std::function<void(size_t)>* job        = nullptr;
+      size_t                             total      = 0;
+      size_t                             active     = 0;
+      uint64_t                           generation = 0;
+      bool                               stopping   = false;
+      std::exception_ptr                 error;
+      std::atomic<size_t>                next       = 0;
+    };
   }
 
 
@@ -59,49 +281,107 @@ namespace risc_n {
 
     using namespace utils_n;
 
-    using lexeme_t = std::string;
-    using lexemes_t = std::vector<lexeme_t>;
-
-    struct rule_t {
-      std::regex regex;
-      std::function<lexeme_t(const std::string&)> get_lexeme;
+    struct lexeme_t {
+      std::string_view value;
+      size_t           line;
+      size_t           column;
     };
 
-    using rules_t = std::vector<rule_t>;
+    using lexemes_t = std::vector<lexeme_t>;
 
-    static inline rules_t rules = {
-      {
-        std::regex("\\s+|;.*?\n"),
-        [](const std::string&) { return ""; }
-      }, {
-        std::regex("[\\w\\d_\\.-]+"),
-        [](const std::string& str) { return str; }
-      }
+    enum symbol_class_t : uint8_t {
+      symbol_other,
+      symbol_space,
+      symbol_comment,
+      symbol_word,    // [\w\d_\.-]
     };
 
-    void process(lexemes_t& lexemes, const std::string& code) {
-      DEBUG_LOGGER_TRACE_LA;
+    static constexpr auto symbols_classes = [] {
+      std::array<uint8_t, 256> classes = {};
+      for (unsigned char c : std::string_view(" \t\n\v\f\r"))
+        classes[c] = symbol_space;
+      for (int c = 'a'; c <= 'z'; ++c)
+        classes[c] = symbol_word;
+      for (int c = 'A'; c <= 'Z'; ++c)
+        classes[c] = symbol_word;
+      for (int c = '0'; c <= '9'; ++c)
+        classes[c] = symbol_word;
+      for (unsigned char c : std::string_view("_.-"))
+        classes[c] = symbol_word;
+      classes[';'] = symbol_comment;
+      return classes;
+    }();
+
+    std::string position(size_t line, size_t column) {
+      return std::to_string(line) + ":" + std::to_string(column);
+    }
 
-      std::string s = code;
-      std::smatch m;
-      while (!s.empty()) {
-        for (const auto& rule : rules) {
-          if (std::regex_search(s, m, rule.regex, std::regex_constants::match_continuous)) {
-            lexeme_t lexeme = rule.get_lexeme(m.str());
-            if (!lexeme.empty()) {
-              lexemes.push_back(lexeme);
-              DEBUG_LOGGER_LA("lexeme: '%s'", m.str().c_str());
+    std::string position(const lexeme_t& lexeme) {
+      return position(lexeme.line, lexeme.column);
+    }
+
+    // Однопроходный сканер: каждый символ исходника читается один раз.
+    // Комментарий ';' длится до конца строки (или до конца файла).
+    struct lexer_t {
+      std::string_view code;
+      size_t           pos    = 0;
+      size_t           line   = 1;
+      size_t           column = 1;
+
+      lexer_t(std::string_view code) : code(code) { }
+
+      bool next(lexeme_t& lexeme) {
+        while (pos < code.size()) {
+          unsigned char c = code[pos];
+          switch (symbols_classes[c]) {
+            case symbol_space:
+              skip();
+              break;
+
+            case symbol_comment:
+              while (pos < code.size() && code[pos] != '\n')
+                skip();
+              break;
+
+            case symbol_word: {
+              size_t start = pos;
+              lexeme.line   = line;
+              lexeme.column = column;
+              while (pos < code.size() && symbols_classes[static_cast<unsigned char>(code[pos])] == symbol_word)
+                ++pos;
+              column += pos - start;
+              lexeme.value  = code.substr(start, pos - start);
+              return true;
             }
-            s = m.suffix().str();
-            break;
+
+            default:
+              throw fatal_error(position(line, column) + ": unexpected symbol '" + std::string(1, c) + "'");
           }
         }
-        if (m.empty() || !m.empty() && !m.length()) {
-          DEBUG_LOGGER_LA("WARN: unexpected regex: '%s'", s.c_str());
-          throw fatal_error("invalid regex");
-          s.erase(s.begin());
+        return false;
+      }
+
+     private:
+      void skip() {
+        if (code[pos++] == '\n') {
+          ++line;
+          column = 1;
+        } else {
+          ++column;
         }
       }
+    };
+
+    // Лексемы ссылаются на code, буфер должен пережить все последующие стадии.
+    void process(lexemes_t& lexemes, std::string_view code) {
+      DEBUG_LOGGER_TRACE_LA;
+
+      lexer_t lexer(code);
+      lexeme_t lexeme;
+      while (lexer.next(lexeme)) {
+        DEBUG_LOGGER_VERBOSE_LA("lexeme: '%.*s'", (int) lexeme.value.size(), lexeme.value.data());
+        lexemes.push_back(lexeme);
+      }
     }
   }
 
@@ -112,59 +392,133 @@ namespace risc_n {
     using namespace utils_n;
     using namespace lexical_analyzer_n;
 
-    static inline std::map<std::string, size_t> cmds_args_count = {
-      { "SET",  2},
-      { "AND",  3},
-      { "OR",   3},
-      { "XOR",  3},
-      { "ADD",  3},
-      { "SUB",  3},
-      { "MULT", 3},
-      { "DIV",  3},
-      { "LSH",  3},
-      { "RSH",  3},
+    struct mnemonic_t {
+      std::string_view name;
+      uint8_t          args_count;
+    };
 
-      { "BR",   2},
-      { "NOT",  2},
-      { "LOAD", 2},
-      { "SAVE", 2},
-      { "MOV",  2},
+    static constexpr auto mnemonics_table = std::to_array<mnemonic_t>({
+      { "SET",  2 },
+      { "AND",  3 },
+      { "OR",   3 },
+      { "XOR",  3 },
+      { "ADD",  3 },
+      { "SUB",  3 },
+      { "MULT", 3 },
+      { "DIV",  3 },
+      { "LSH",  3 },
+      { "RSH",  3 },
+
+      { "BR",   2 },
+      { "NOT",  2 },
+      { "LOAD", 2 },
+      { "SAVE", 2 },
+      { "MOV",  2 },
+      { "LOAD8",  2 },
+      { "LOAD16", 2 },
+      { "LOAD32", 2 },
+      { "SAVE8",  2 },
+      { "SAVE16", 2 },
+      { "SAVE32", 2 },
+      { "HCALL",  2 },
+      { "HBATCH", 2 },
+
+      { "CALL", 1 },
+
+      { "RET",  0 },
+      { "YIELD", 0 },
 
-      { "CALL", 1},
+      // Временные команды, которые будут преобразованы в другие
+      { "FUNCTION", 1 },
+      { "LABEL",    1 },
+      { "ADDRESS",  2 },
+    });
 
-      { "RET",  0},
+    static constexpr auto mnemonics_hash = make_perfect_hash<128>(mnemonics_table);
 
-      // Временные команды, которые будут преобразованы в другие
-      { "FUNCTION", 1},
-      { "LABEL",    1},
-      { "ADDRESS",  2},
-    };
+    static constexpr uint8_t mnemonic_unknown = 0xFF;
 
-    using cmds_str_t = std::vector<std::vector<std::string>>;
+    constexpr uint8_t mnemonic_index(std::string_view name) {
+      auto slot = mnemonics_hash.slots[mnemonics_hash.slot(name)];
+      if (!slot || mnemonics_table[slot - 1].name != name)
+        return mnemonic_unknown;
+      return slot - 1;
+    }
 
-    void process(cmds_str_t& cmds_str, const lexemes_t& lexemes) {
-      size_t i = 0;
-      while (i < lexemes.size()) {
-        auto lexeme = lexemes.at(i++);
-        std::vector<std::string> cmd = { lexeme };
-        DEBUG_LOGGER_SA("lexeme: '%s'", lexeme.c_str());
-        if (cmds_args_count.find(lexeme) == cmds_args_count.end()) {
-          throw fatal_error("unknown lexeme");
-        }
-        for (size_t j = 0; j < cmds_args_count[lexeme]; ++j) {
-          auto lexeme_arg = lexemes.at(i++);
-          cmd.push_back(lexeme_arg);
-          DEBUG_LOGGER_SA("  lexeme_arg: '%s'", lexeme_arg.c_str());
-        }
-        cmds_str.push_back(cmd);
+    consteval uint8_t mnemonic_index_c(std::string_view name) {
+      if (mnemonic_index(name) == mnemonic_unknown)
+        throw fatal_error("unknown mnemonic");
+      return mnemonic_index(name);
+    }
+
+    // Команда фиксированного размера: аргументы ссылаются на исходный текст.
+    struct cmd_t {
+      uint8_t          mnemonic;
+      uint8_t          args_count;
+      uint32_t         line;
+      uint32_t         column;
+      std::string_view args[3];
+
+      std::string_view name() const {
+        return mnemonics_table[mnemonic].name;
       }
+    };
+
+    using cmds_t = std::vector<cmd_t>;
+
+    std::string position(const cmd_t& cmd) {
+      return lexical_analyzer_n::position(cmd.line, cmd.column);
     }
-  }
 
+    // Разбор по одной лексеме, чтобы лексемы можно было подавать потоком:
+    // push возвращает true, когда команда со всеми аргументами собрана.
+    struct parser_t {
+      cmd_t  cmd    = {};
+      size_t filled = 0;       // аргументов cmd уже прочитано
+      bool   open   = false;   // cmd ждет аргументы
 
+      bool push(const lexeme_t& lexeme, cmd_t& out) {
+        if (!open) {
+          DEBUG_LOGGER_VERBOSE_SA("lexeme: '%.*s'", (int) lexeme.value.size(), lexeme.value.data());
 
-  namespace semantic_analyzer_n {
+          auto mnemonic = mnemonic_index(lexeme.value);
+          if (mnemonic == mnemonic_unknown) {
+            throw fatal_error(position(lexeme) + ": unknown lexeme '" + std::string(lexeme.value) + "'");
+          }
+
+          cmd = { mnemonic, mnemonics_table[mnemonic].args_count,
+            static_cast<uint32_t>(lexeme.line), static_cast<uint32_t>(lexeme.column), {} };
+          filled = 0;
+          open   = true;
+        } else {
+          cmd.args[filled++] = lexeme.value;
+          DEBUG_LOGGER_VERBOSE_SA("  lexeme_arg: '%.*s'", (int) lexeme.value.size(), lexeme.value.data());
+        }
+
+        if (filled < cmd.args_count)
+          return false;
+        open = false;
+        out  = cmd;
+        return true;
+      }
+
+      void finish() const {
+        if (open)
+          throw fatal_error(position(cmd) + ": not enough arguments for '" + std::string(cmd.name()) + "'");
+      }
+    };
+
+    void process(cmds_t& cmds, const lexemes_t& lexemes) {
+      cmds.reserve(cmds.size() + lexemes.size() / 3);
 
+      parser_t parser;
+      cmd_t cmd;
+      for (const auto& lexeme : lexemes) {
+        if (parser.push(lexeme, cmd))
+          cmds.push_back(cmd);
+      }
+      parser.finish();
+    }
   }
 
 
@@ -192,12 +546,12 @@ namespace risc_n {
     using instructions_t = std::vector<instruction_t>;
 
     struct opcode_index_t {
-      uint8_t     offset;
-      uint8_t     index;
-      std::string name;
+      uint8_t          offset;
+      uint8_t          index;
+      std::string_view name;
     };
 
-    static inline std::vector<opcode_index_t> opcodes_table = {
+    static constexpr auto opcodes_table = std::to_array<opcode_index_t>({
       {  0,  0, "SET"  },
       {  0,  1, "AND"  },
       {  0,  2, "OR"   },
@@ -208,6 +562,7 @@ namespace risc_n {
       {  0,  7, "DIV"  },
       {  0,  8, "LSH"  },
       {  0,  9, "RSH"  },
+      {  0, 10, "CONST" },
       // ...
       {  0, 15, "OTH0" },
       {  1,  0, "BR"   },
@@ -215,21 +570,30 @@ namespace risc_n {
       {  1,  2, "LOAD" },
       {  1,  3, "SAVE" },
       {  1,  4, "MOV"  },
+      {  1,  5, "LOAD8"  },
+      {  1,  6, "LOAD16" },
+      {  1,  7, "LOAD32" },
+      {  1,  8, "SAVE8"  },
+      {  1,  9, "SAVE16" },
+      {  1, 10, "SAVE32" },
+      {  1, 11, "HCALL"  },
+      {  1, 12, "HBATCH" },
       // ...
       {  1, 15, "OTH1" },
       {  2,  0, "CALL" },
       // ...
       {  2, 15, "OTH2" },
       {  3,  0, "RET"  },
+      {  3,  1, "YIELD" },
       // ...
-    };
+    });
 
     struct reg_index_t {
-      uint8_t     index;
-      std::string name;
+      uint8_t          index;
+      std::string_view name;
     };
 
-    static inline std::vector<reg_index_t> regs_table = {
+    static constexpr auto regs_table = std::to_array<reg_index_t>({
       {   0, "RI"  },   // instruction pointer
       {   1, "RP"  },   // previous base pointer
       {   2, "RB"  },   // base pointer
@@ -246,7 +610,7 @@ namespace risc_n {
       {  13, "R6"  },
       {  14, "R7"  },
       {  15, "R8"  },
-    };
+    });
 
     using reg_value_t = int64_t;
     using reg_uvalue_t = std::make_unsigned<reg_value_t>::type;
@@ -262,42 +626,86 @@ namespace risc_n {
     // INC      Ra Rb:   add(Ra, Ra, Rb);
     // DEC      Ra Rb:   sub(Ra, Ra, Rb);
 
-    using functions_t = std::map<std::string, size_t>;
+    using functions_t = std::map<std::string, size_t, std::less<>>;
+
+    // Место в instructions, куда ADDRESS подставил адрес функции name:
+    // [index, index + size) - последовательность macro_set в регистр rd.
+    struct relocation_t {
+      size_t      index;
+      size_t      size;
+      uint8_t     rd;
+      std::string name;
+    };
+
+    using relocations_t = std::vector<relocation_t>;
+
+    // Пул констант программы: CONST Rd i загружает constants[i]. Индекс занимает
+    // байт, как значение SET, поэтому в пуле не больше constants_limit значений.
+    using constants_t = std::vector<reg_value_t>;
+
+    static constexpr size_t constants_limit = 256;
+
+    static constexpr auto opcodes_hash = make_perfect_hash<128>(opcodes_table);
+    static constexpr auto regs_hash    = make_perfect_hash<64>(regs_table);
+
+    // opcodes_names[offset][index]
+    static constexpr auto opcodes_names = [] {
+      std::array<std::array<std::string_view, 16>, 4> names = {};
+      for (const auto& opcode : opcodes_table) {
+        if (opcode.offset >= names.size() || opcode.index >= names[opcode.offset].size())
+          throw fatal_error("invalid opcode");
+        if (!names[opcode.offset][opcode.index].empty())
+          throw fatal_error("opcode exists");
+        names[opcode.offset][opcode.index] = opcode.name;
+      }
+      return names;
+    }();
+
+    static_assert([] {
+      for (size_t i = 0; i < regs_table.size(); ++i) {
+        if (regs_table[i].index != i)
+          return false;
+      }
+      return regs_table.size() == 16;
+    }(), "regs_table must be indexed by register number");
 
-    uint8_t opcode_index(uint8_t offset, const std::string& name) {
-      auto it = std::find_if(opcodes_table.begin(), opcodes_table.end(),
-          [offset, name](auto& opcode) { return opcode.offset == offset && opcode.name == name; });
-      if (it == opcodes_table.end()) {
+    constexpr uint8_t opcode_index(uint8_t offset, std::string_view name) {
+      auto slot = opcodes_hash.slots[opcodes_hash.slot(name)];
+      if (!slot || opcodes_table[slot - 1].name != name || opcodes_table[slot - 1].offset != offset) {
         throw fatal_error("unknown opcode");
       }
-      return it->index;
+      return opcodes_table[slot - 1].index;
     }
 
-    std::string opcode_name(uint8_t offset, uint8_t index) {
-      auto it = std::find_if(opcodes_table.begin(), opcodes_table.end(),
-          [offset, index](auto& opcode) { return opcode.offset == offset && opcode.index == index; });
-      if (it == opcodes_table.end()) {
+    constexpr std::string_view opcode_name(uint8_t offset, uint8_t index) {
+      if (offset >= opcodes_names.size() || index >= opcodes_names[offset].size() || opcodes_names[offset][index].empty()) {
         throw fatal_error("unknown opcode");
       }
-      return it->name;
+      return opcodes_names[offset][index];
     }
 
-    uint8_t reg_index(const std::string& name) {
-      auto it = std::find_if(regs_table.begin(), regs_table.end(),
-          [name](auto& reg) { return reg.name == name; });
-      if (it == regs_table.end()) {
+    constexpr uint8_t reg_index(std::string_view name) {
+      auto slot = regs_hash.slots[regs_hash.slot(name)];
+      if (!slot || regs_table[slot - 1].name != name) {
         throw fatal_error("unknown reg");
       }
-      return it->index;
+      return regs_table[slot - 1].index;
     }
 
-    std::string reg_name(uint8_t index) {
-      auto it = std::find_if(regs_table.begin(), regs_table.end(),
-          [index](auto& reg) { return reg.index == index; });
-      if (it == regs_table.end()) {
+    constexpr std::string_view reg_name(uint8_t index) {
+      if (index >= regs_table.size()) {
         throw fatal_error("unknown reg");
       }
-      return it->name;
+      return regs_table[index].name;
+    }
+
+    // Для имен, известных при компиляции: опечатка - ошибка компиляции.
+    consteval uint8_t opcode_index_c(uint8_t offset, std::string_view name) {
+      return opcode_index(offset, name);
+    }
+
+    consteval uint8_t reg_index_c(std::string_view name) {
+      return reg_index(name);
     }
 
     std::string print_instruction(instruction_t instruction) {
@@ -306,14 +714,14 @@ namespace risc_n {
       ss << std::hex << std::setfill('0') << std::setw(2 * sizeof(instruction.value))
           << instruction.value << "   ";
 
-      if (instruction.cmd_set.op == opcode_index(0, "SET")) {
+      if (instruction.cmd_set.op == opcode_index_c(0, "SET") || instruction.cmd_set.op == opcode_index_c(0, "CONST")) {
         ss << opcode_name(0, instruction.cmd_set.op) << " "
           << reg_name(instruction.cmd_set.rd) << " "
           << (reg_value_t) instruction.cmd_set.val << " ";
       } else {
-        if (instruction.cmd.op == opcode_index(0, "OTH0")) {
-          if (instruction.cmd.rd == opcode_index(1, "OTH1")) {
-            if (instruction.cmd.rs1 == opcode_index(2, "OTH2")) {
+        if (instruction.cmd.op == opcode_index_c(0, "OTH0")) {
+          if (instruction.cmd.rd == opcode_index_c(1, "OTH1")) {
+            if (instruction.cmd.rs1 == opcode_index_c(2, "OTH2")) {
                 ss << opcode_name(3, instruction.cmd.rs2) << " ";
             } else {
               ss << opcode_name(2, instruction.cmd.rs1) << " "
@@ -335,6 +743,8 @@ namespace risc_n {
       return ss.str();
     };
 
+    // Старший ненулевой байт загружается сразу, остальные вдвигаются через RT:
+    // значение до 255 - один SET, RT после последовательности не определен.
     void macro_set(instructions_t& instructions, uint8_t rd, reg_value_t value) {
       DEBUG_LOGGER_TRACE_ICG;
       // DEBUG_LOGGER_ICG("rd: '%x'", rd);
@@ -345,293 +755,6134 @@ namespace risc_n {
       std::reverse(std::begin(bytes), std::end(bytes));
 
       size_t i = 0;
-      for (; i < sizeof(bytes); i++) {
-        if (bytes[i])
-          break;
-      }
+      while (i + 1 < sizeof(bytes) && !bytes[i])
+        ++i;
 
-      instructions.push_back({ .cmd_set = { opcode_index(0, "SET"), rd, 0 } });
+      instructions.push_back({ .cmd_set = { opcode_index_c(0, "SET"), rd, bytes[i++] } });
 
-      auto rt = reg_index("RT");
+      auto rt = reg_index_c("RT");
 
       for (; i < sizeof(bytes); i++) {
-        instructions.push_back({ .cmd_set = { opcode_index(0, "SET"), rt, 8 } });
-        instructions.push_back({ .cmd     = { opcode_index(0, "LSH"), rd, rd, rt } });
-        instructions.push_back({ .cmd_set = { opcode_index(0, "SET"), rt, bytes[i] } });
-        instructions.push_back({ .cmd     = { opcode_index(0, "OR"),  rd, rd, rt } });
+        instructions.push_back({ .cmd_set = { opcode_index_c(0, "SET"), rt, 8 } });
+        instructions.push_back({ .cmd     = { opcode_index_c(0, "LSH"), rd, rd, rt } });
+        instructions.push_back({ .cmd_set = { opcode_index_c(0, "SET"), rt, bytes[i] } });
+        instructions.push_back({ .cmd     = { opcode_index_c(0, "OR"),  rd, rd, rt } });
       }
     }
 
-    void process(instructions_t& instructions, functions_t& functions, const cmds_str_t& cmds_str) {
-      for (auto cmd_str : cmds_str) {
-        if (cmd_str.at(0) == "SET" && cmd_str.size() == 3) {
-          auto op = opcode_index(0, cmd_str.at(0));
-          auto rd = reg_index(cmd_str.at(1));
-          reg_value_t value = strtol(cmd_str.at(2).c_str(), nullptr, 0);
-          macro_set(instructions, rd, value);
+    // Длина последовательности macro_set для value.
+    size_t macro_set_size(reg_value_t value) {
+      size_t bytes = 0;
+      for (auto v = static_cast<reg_uvalue_t>(value); v; v >>= 8)
+        ++bytes;
+      return bytes <= 1 ? 1 : 1 + 4 * (bytes - 1);
+    }
 
-        } else if (cmd_str.at(0) == "FUNCTION" && cmd_str.size() == 2) {
-          auto name = cmd_str.at(1);
+    bool fits_set(reg_value_t value) {
+      return value >= 0 && value <= std::numeric_limits<uint8_t>::max();
+    }
 
-          if (functions.find(name) != functions.end())
-            throw fatal_error("function exists");
+    // Как strtol(.., 0): 0x - шестнадцатеричное, ведущий 0 - восьмеричное.
+    reg_value_t parse_value(const cmd_t& cmd, std::string_view str) {
+      std::string_view digits = str;
+      bool negative = !digits.empty() && digits.front() == '-';
+      if (negative)
+        digits.remove_prefix(1);
+
+      int base = 10;
+      if (digits.size() > 2 && digits[0] == '0' && (digits[1] == 'x' || digits[1] == 'X')) {
+        base = 16;
+        digits.remove_prefix(2);
+      } else if (digits.size() > 1 && digits[0] == '0') {
+        base = 8;
+        digits.remove_prefix(1);
+      }
 
-          functions[name] = instructions.size() * sizeof(instruction_t);
+      reg_uvalue_t value = 0;
+      auto [end, ec] = std::from_chars(digits.data(), digits.data() + digits.size(), value, base);
+      if (digits.empty() || ec != std::errc() || end != digits.data() + digits.size())
+        throw fatal_error(position(cmd) + ": invalid value '" + std::string(str) + "'");
 
-        } else if (cmd_str.at(0) == "LABEL") {
-          throw fatal_error("LABEL TODO");
+      return static_cast<reg_value_t>(negative ? -value : value);
+    }
 
-        } else if (cmd_str.at(0) == "ADDRESS" && cmd_str.size() == 3) {
-          auto rd   = reg_index(cmd_str.at(1));
-          auto name = cmd_str.at(2);
+    uint8_t reg_index(const cmd_t& cmd, std::string_view name) {
+      auto slot = regs_hash.slots[regs_hash.slot(name)];
+      if (!slot || regs_table[slot - 1].name != name)
+        throw fatal_error(position(cmd) + ": unknown reg '" + std::string(name) + "'");
+      return regs_table[slot - 1].index;
+    }
 
-          if (functions.find(name) == functions.end())
-            throw fatal_error("function not exists");
+    // Секция - код одной функции (или код до первой FUNCTION), собранный независимо
+    // от остальных. Вместо последовательностей ADDRESS и SET больших значений в секции
+    // ссылки: кодировку выбирает link, когда известны пул констант и адреса функций,
+    // поэтому ADDRESS может ссылаться на функцию ниже по тексту.
+    struct reference_t {
+      size_t           index;    // место в instructions секции
+      uint8_t          rd;
+      std::string_view name;     // пусто - константа value
+      uint32_t         line;
+      uint32_t         column;
+      reg_value_t      value = 0;
+    };
 
-          macro_set(instructions, rd, functions[name]);
+    struct label_t {
+      std::string_view name;
+      size_t           index;        // место в instructions секции
+      size_t           references;   // ссылок секции до метки
+      uint32_t         line;
+      uint32_t         column;
+    };
 
-        } else if (cmd_str.size() == 4) {
-          auto op  = opcode_index(0, cmd_str.at(0));
-          auto rd  = reg_index(cmd_str.at(1));
-          auto rs1 = reg_index(cmd_str.at(2));
-          auto rs2 = reg_index(cmd_str.at(3));
-          instructions.push_back({ .cmd  = { op, rd, rs1, rs2 } });
+    struct section_t {
+      std::string_view         name;     // пусто у кода до первой FUNCTION
+      uint32_t                 line   = 0;
+      uint32_t                 column = 0;
+      instructions_t           instructions;
+      std::vector<reference_t> references;
+      std::vector<label_t>     labels;
+    };
 
-        } else if (cmd_str.size() == 3) {
-          auto op1 = opcode_index(0, "OTH0");
-          auto op2 = opcode_index(1, cmd_str.at(0));
-          auto rd  = reg_index(cmd_str.at(1));
-          auto rs  = reg_index(cmd_str.at(2));
-          instructions.push_back({ .cmd  = { op1, op2, rd, rs } });
+    using sections_t = std::vector<section_t>;
 
-        } else if (cmd_str.size() == 2) {
-          auto op1 = opcode_index(0, "OTH0");
-          auto op2 = opcode_index(1, "OTH1");
-          auto op3 = opcode_index(2, cmd_str.at(0));
-          auto rd  = reg_index(cmd_str.at(1));
-          instructions.push_back({ .cmd  = { op1, op2, op3, rd } });
+    // Метки видны только внутри своей функции и попадают в functions_t под именем
+    // "функция:метка": ':' не входит в имена, поэтому с функциями они не пересекаются.
+    std::string label_symbol(std::string_view section, std::string_view label) {
+      std::string name;
+      name.reserve(section.size() + 1 + label.size());
+      name.append(section).append(1, ':').append(label);
+      return name;
+    }
 
-        } else if (cmd_str.size() == 1) {
-          auto op1 = opcode_index(0, "OTH0");
-          auto op2 = opcode_index(1, "OTH1");
-          auto op3 = opcode_index(2, "OTH2");
-          auto op4 = opcode_index(3, cmd_str.at(0));
-          instructions.push_back({ .cmd  = { op1, op2, op3, op4 } });
+    constexpr bool is_label(std::string_view name) {
+      return name.find(':') != std::string_view::npos;
+    }
 
-        } else {
-          throw fatal_error("unknown cmd format");
-        }
-      }
+    // Команда в секцию; FUNCTION открывает новую секцию у вызывающего.
+    void assemble(section_t& section, const cmd_t& cmd) {
+      auto& instructions = section.instructions;
+
+      if (cmd.mnemonic == mnemonic_index_c("FUNCTION")) {
+        throw fatal_error(position(cmd) + ": FUNCTION inside section");
+
+      } else if (cmd.mnemonic == mnemonic_index_c("SET")) {
+        auto rd    = reg_index(cmd, cmd.args[0]);
+        auto value = parse_value(cmd, cmd.args[1]);
+        if (fits_set(value))
+          instructions.push_back({ .cmd_set = { opcode_index_c(0, "SET"), rd, static_cast<uint8_t>(value) } });
+        else
+          section.references.push_back({ instructions.size(), rd, {}, cmd.line, cmd.column, value });
+
+      } else if (cmd.mnemonic == mnemonic_index_c("LABEL")) {
+        section.labels.push_back({ cmd.args[0], instructions.size(), section.references.size(), cmd.line, cmd.column });
+
+      } else if (cmd.mnemonic == mnemonic_index_c("ADDRESS")) {
+        auto rd = reg_index(cmd, cmd.args[0]);
+        section.references.push_back({ instructions.size(), rd, cmd.args[1], cmd.line, cmd.column });
+
+      } else if (cmd.args_count == 3) {
+        auto op  = opcode_index(0, cmd.name());
+        auto rd  = reg_index(cmd, cmd.args[0]);
+        auto rs1 = reg_index(cmd, cmd.args[1]);
+        auto rs2 = reg_index(cmd, cmd.args[2]);
+        instructions.push_back({ .cmd  = { op, rd, rs1, rs2 } });
+
+      } else if (cmd.args_count == 2) {
+        auto op1 = opcode_index_c(0, "OTH0");
+        auto op2 = opcode_index(1, cmd.name());
+        auto rd  = reg_index(cmd, cmd.args[0]);
+        auto rs  = reg_index(cmd, cmd.args[1]);
+        instructions.push_back({ .cmd  = { op1, op2, rd, rs } });
+
+      } else if (cmd.args_count == 1) {
+        auto op1 = opcode_index_c(0, "OTH0");
+        auto op2 = opcode_index_c(1, "OTH1");
+        auto op3 = opcode_index(2, cmd.name());
+        auto rd  = reg_index(cmd, cmd.args[0]);
+        instructions.push_back({ .cmd  = { op1, op2, op3, rd } });
+
+      } else if (cmd.args_count == 0) {
+        auto op1 = opcode_index_c(0, "OTH0");
+        auto op2 = opcode_index_c(1, "OTH1");
+        auto op3 = opcode_index_c(2, "OTH2");
+        auto op4 = opcode_index(3, cmd.name());
+        instructions.push_back({ .cmd  = { op1, op2, op3, op4 } });
 
-      for (size_t i = 0; i < instructions.size(); ++i) {
-        DEBUG_LOGGER_ICG("instruction: %08x '%s'", i * sizeof(instruction_t), print_instruction(instructions[i]).c_str());
+      } else {
+        throw fatal_error(position(cmd) + ": unknown cmd format");
       }
     }
-  }
-
 
+    // Склейка секций. Места в пуле констант получают самые частые значения SET
+    // и адреса ADDRESS (адрес - отдельно от равного ему значения: его меняет
+    // оптимизатор), такая ссылка - одна CONST. Остальные - macro_set, и адреса
+    // функций и меток зависят от длины последовательностей ADDRESS, а длины -
+    // от адресов. Длины только растут от минимальных, поэтому итерации сходятся.
+    // После раскладки место каждой секции известно, и секции копируются на pool.
+    void link(instructions_t& instructions, functions_t& functions, relocations_t& relocations, constants_t& constants,
+        const sections_t& sections, thread_pool_t* pool = nullptr) {
+      DEBUG_LOGGER_TRACE_ICG;
 
-  namespace code_optimizer_n {
-  }
+      static constexpr size_t npos = std::numeric_limits<size_t>::max();
+
+      // Символ - начало функции или метка: место в секции и число ссылок перед ним.
+      struct symbol_t {
+        size_t      section;
+        size_t      index;
+        size_t      references;
+        std::string name;   // имя в functions_t
+      };
+
+      // Имена разрешаются один раз, дальше раскладка работает с индексами символов.
+      std::vector<symbol_t> symbols;
+      std::unordered_map<std::string_view, size_t> indexes;
+      indexes.reserve(sections.size());
+      for (size_t s = 0; s < sections.size(); ++s) {
+        const auto& section = sections[s];
+        if (section.name.empty())
+          continue;
+        if (functions.find(section.name) != functions.end() || !indexes.emplace(section.name, symbols.size()).second)
+          throw fatal_error(lexical_analyzer_n::position(section.line, section.column) + ": function exists");
+        symbols.push_back({ s, 0, 0, std::string(section.name) });
+      }
 
+      std::vector<size_t> first(sections.size() + 1);   // первая ссылка секции
+      std::vector<size_t> targets;                       // символ ADDRESS, npos - константа
+      std::vector<reg_value_t> values;                   // значение константы
+      std::unordered_map<std::string_view, size_t> local;
+      for (size_t s = 0; s < sections.size(); ++s) {
+        const auto& section = sections[s];
+        local.clear();
+        for (const auto& label : section.labels) {
+          if (!local.emplace(label.name, symbols.size()).second)
+            throw fatal_error(lexical_analyzer_n::position(label.line, label.column) + ": label exists");
+          symbols.push_back({ s, label.index, label.references, label_symbol(section.name, label.name) });
+        }
 
+        first[s] = targets.size();
+        for (const auto& reference : section.references) {
+          values.push_back(reference.value);
+          if (reference.name.empty()) {
+            targets.push_back(npos);
+            continue;
+          }
+          auto it = local.find(reference.name);
+          if (it == local.end() && (it = indexes.find(reference.name)) == indexes.end())
+            throw fatal_error(lexical_analyzer_n::position(reference.line, reference.column) + ": function not exists");
+          targets.push_back(it->second);
+        }
+      }
+      first.back() = targets.size();
+
+      // Кандидаты в пул: различные значения и символы, по числу ссылок,
+      // при равенстве - в порядке первой ссылки.
+      struct candidate_t {
+        size_t uses;
+        size_t symbol;   // npos - значение value
+        reg_value_t value;
+      };
+      std::vector<candidate_t> candidates;
+      std::vector<size_t> candidate(targets.size());
+      std::unordered_map<reg_value_t, size_t> by_value;
+      std::vector<size_t> by_symbol(symbols.size(), npos);
+      for (size_t r = 0; r < targets.size(); ++r) {
+        auto& c = targets[r] == npos ? by_value.try_emplace(values[r], npos).first->second : by_symbol[targets[r]];
+        if (c == npos) {
+          c = candidates.size();
+          candidates.push_back({ 0, targets[r], values[r] });
+        }
+        ++candidates[c].uses;
+        candidate[r] = c;
+      }
 
-  namespace code_generator_n {
-    using namespace intermediate_code_generator_n;
+      std::vector<size_t> order(candidates.size());
+      std::iota(order.begin(), order.end(), 0);
+      std::stable_sort(order.begin(), order.end(),
+          [&](size_t a, size_t b) { return candidates[a].uses > candidates[b].uses; });
 
-    void process(data_t& text, const instructions_t& instructions) {
-      text.assign(sizeof(instruction_t) * instructions.size(), 0);
-      for (size_t i = 0; i < instructions.size(); ++i) {
-        memcpy(text.data() + i * sizeof(instruction_t), &instructions[i].value, sizeof(instruction_t));
+      [[maybe_unused]] size_t constants_base = constants.size();
+      std::vector<size_t> entries(candidates.size(), npos);   // место кандидата в пуле
+      for (size_t i = 0; i < order.size() && constants.size() < constants_limit; ++i) {
+        entries[order[i]] = constants.size();
+        constants.push_back(candidates[order[i]].value);
       }
 
-      for (size_t i = 0; i < text.size(); i += sizeof(instruction_t)) {
-        DEBUG_LOGGER_CG("text: '%02hhx%02hhx'", text.at(i), text.at(i + 1));
+      std::vector<size_t> sizes(targets.size(), 1);
+      std::vector<size_t> before(targets.size());           // длина ссылок секции до ссылки
+      std::vector<size_t> offsets(sections.size() + 1);     // в инструкциях
+      std::vector<size_t> addresses(symbols.size());        // в инструкциях
+      for (size_t r = 0; r < targets.size(); ++r) {
+        if (targets[r] == npos && entries[candidate[r]] == npos)
+          sizes[r] = macro_set_size(values[r]);
       }
-    }
-  }
 
+      bool changed = true;
+      while (changed) {
+        size_t offset = instructions.size();
+        for (size_t s = 0; s < sections.size(); ++s) {
+          offsets[s] = offset;
+          size_t within = 0;
+          for (size_t r = first[s]; r < first[s + 1]; ++r) {
+            before[r] = within;
+            within += sizes[r];
+          }
+          offset += sections[s].instructions.size() + within;
+        }
+        offsets.back() = offset;
 
+        for (size_t i = 0; i < symbols.size(); ++i) {
+          const auto& symbol = symbols[i];
+          size_t r = first[symbol.section] + symbol.references;
+          addresses[i] = offsets[symbol.section] + symbol.index
+            + (symbol.references ? before[r - 1] + sizes[r - 1] : 0);
+        }
 
-  namespace executor_n {
+        changed = false;
+        for (size_t r = 0; r < targets.size(); ++r) {
+          if (targets[r] == npos || entries[candidate[r]] != npos)
+            continue;
+          auto size = macro_set_size(addresses[targets[r]] * sizeof(instruction_t));
+          if (size != sizes[r]) {
+            sizes[r] = size;
+            changed = true;
+          }
+        }
+      }
 
-    using namespace intermediate_code_generator_n;
+      for (size_t i = 0; i < symbols.size(); ++i)
+        functions.emplace(symbols[i].name, addresses[i] * sizeof(instruction_t));
 
-    using registers_set_t = reg_value_t[16];
+      for (size_t c = 0; c < candidates.size(); ++c) {
+        if (entries[c] != npos && candidates[c].symbol != npos)
+          constants[entries[c]] = addresses[candidates[c].symbol] * sizeof(instruction_t);
+      }
 
-    std::string print_stack(const data_t& stack, registers_set_t* registers_set) {
-      std::stringstream ss;
-      ss << std::endl;
+      // Перемещения только у ADDRESS, в порядке текста.
+      std::vector<size_t> relocation(targets.size());
+      size_t relocations_base = relocations.size();
+      for (size_t r = 0; r < targets.size(); ++r) {
+        relocation[r] = relocations_base;
+        if (targets[r] != npos)
+          ++relocations_base;
+      }
+      relocations.resize(relocations_base);
+      instructions.resize(offsets.back());
+
+      auto emit = [&](size_t s) {
+        const auto& section = sections[s];
+        auto out = instructions.begin() + offsets[s];
+        instructions_t sequence;
+        size_t i = 0;
+        for (size_t r = first[s]; r < first[s + 1]; ++r) {
+          const auto& reference = section.references[r - first[s]];
+          out = std::copy(section.instructions.begin() + i, section.instructions.begin() + reference.index, out);
+          i = reference.index;
+
+          sequence.clear();
+          auto entry = entries[candidate[r]];
+          if (entry != npos)
+            sequence.push_back({ .cmd_set = { opcode_index_c(0, "CONST"), reference.rd, static_cast<uint8_t>(entry) } });
+          else
+            macro_set(sequence, reference.rd, targets[r] == npos ? values[r] : addresses[targets[r]] * sizeof(instruction_t));
+          if (targets[r] != npos)
+            relocations[relocation[r]] = { static_cast<size_t>(out - instructions.begin()), sequence.size(),
+              reference.rd, symbols[targets[r]].name };
+          out = std::copy(sequence.begin(), sequence.end(), out);
+        }
+        std::copy(section.instructions.begin() + i, section.instructions.end(), out);
+      };
 
-      for (uint8_t i = 0; i < 16; ++i) {
-        ss << reg_name(i) << "   " << std::hex << std::setfill('0') << std::setw(2 * sizeof(reg_value_t))
-          << (*registers_set)[i] << std::endl;
+      if (pool && sections.size() > 1) {
+        pool->parallel_for(sections.size(), emit);
+      } else {
+        for (size_t s = 0; s < sections.size(); ++s)
+          emit(s);
       }
 
-      ss << "size: " << (reinterpret_cast<const uint8_t*>(registers_set) - reinterpret_cast<const uint8_t*>(stack.data())) << std::endl;
+      DEBUG_LOGGER_ICG("constants: %zu", constants.size() - constants_base);
+      for (size_t i = 0; i < instructions.size(); ++i) {
+        DEBUG_LOGGER_VERBOSE_ICG("instruction: %08x '%s'", i * sizeof(instruction_t), print_instruction(instructions[i]).c_str());
+      }
+    }
 
-      for (size_t i = (*registers_set)[reg_index("RB")]; i < (*registers_set)[reg_index("RS")]; ++i) {
-        ss << "stack data: " << std::hex << std::setfill('0') << std::setw(2 * sizeof(uint8_t))
-          << (uint64_t) stack.at(i) << std::endl;
+    // Генерация по одной команде, чтобы команды можно было подавать потоком.
+    struct generator_t {
+      instructions_t& instructions;
+      functions_t&    functions;
+      relocations_t&  relocations;
+      constants_t&    constants;
+      sections_t      sections = sections_t(1);
+
+      void push(const cmd_t& cmd) {
+        if (cmd.mnemonic == mnemonic_index_c("FUNCTION"))
+          sections.push_back({ cmd.args[0], cmd.line, cmd.column, {}, {}, {} });
+        else
+          assemble(sections.back(), cmd);
       }
 
-      return ss.str();
-    }
+      void finish() {
+        link(instructions, functions, relocations, constants, sections);
+      }
+    };
 
-    void exec_cmd3(const data_t& text, data_t& stack, registers_set_t*& registers_set, instruction_t instruction) {
-      if (instruction.cmd.rs2 == opcode_index(3, "RET")) {
-        if (!(*registers_set)[reg_index("RP")])
-          throw fatal_error("exit TODO");
-        registers_set_t* registers_set_new = reinterpret_cast<registers_set_t*>(stack.data()
-            + (*registers_set)[reg_index("RP")] - sizeof(registers_set_t));
-        registers_set = registers_set_new;
-      } else {
-        throw fatal_error("unknown cmd3");
+    // Команды делятся на секции по FUNCTION, секции собираются на pool (если задан),
+    // ошибка сообщается по первой в тексте секции.
+    void process(instructions_t& instructions, functions_t& functions, relocations_t& relocations, constants_t& constants,
+        const cmds_t& cmds, thread_pool_t* pool = nullptr) {
+      std::vector<size_t> bounds = { 0 };
+      for (size_t i = 0; i < cmds.size(); ++i) {
+        if (cmds[i].mnemonic == mnemonic_index_c("FUNCTION"))
+          bounds.push_back(i);
       }
-    }
+      bounds.push_back(cmds.size());
+
+      sections_t sections(bounds.size() - 1);
+      std::vector<std::exception_ptr> errors(sections.size());
+
+      auto build = [&](size_t s) {
+        try {
+          auto& section = sections[s];
+          size_t begin = bounds[s];
+          if (s) {
+            const auto& cmd = cmds[begin++];
+            section.name   = cmd.args[0];
+            section.line   = cmd.line;
+            section.column = cmd.column;
+          }
+          for (size_t i = begin; i < bounds[s + 1]; ++i)
+            assemble(section, cmds[i]);
+        } catch (...) {
+          errors[s] = std::current_exception();
+        }
+      };
 
-    void exec_cmd2(const data_t& text, data_t& stack, registers_set_t*& registers_set, instruction_t instruction) {
-      if (instruction.cmd.rs1 == opcode_index(2, "CALL")) {
-        registers_set_t* registers_set_new = reinterpret_cast<registers_set_t*>(stack.data()
-            + (*registers_set)[reg_index("RS")]);
-        (*registers_set_new)[reg_index("RI")] = (*registers_set)[instruction.cmd.rs2];
-        (*registers_set_new)[reg_index("RP")] = (*registers_set)[reg_index("RB")];
-        (*registers_set_new)[reg_index("RB")] = (*registers_set)[reg_index("RS")] + sizeof(registers_set_t);
-        (*registers_set_new)[reg_index("RS")] = (*registers_set_new)[reg_index("RB")];
-        registers_set = registers_set_new;
-      } else if (instruction.cmd.rs1 == opcode_index(2, "OTH2")) {
-        exec_cmd3(text, stack, registers_set, instruction);
-      } else {
-        throw fatal_error("unknown cmd2");
-      }
-    }
-
-    void exec_cmd1(const data_t& text, data_t& stack, registers_set_t*& registers_set, instruction_t instruction) {
-      if (instruction.cmd.rd == opcode_index(1, "BR")) {
-        throw fatal_error("BR TODO");
-      } else if (instruction.cmd.rd == opcode_index(1, "NOT")) {
-        (*registers_set)[instruction.cmd.rs1] = ~(*registers_set)[instruction.cmd.rs2];
-      } else if (instruction.cmd.rd == opcode_index(1, "LOAD")) {
-        throw fatal_error("LOAD TODO");
-      } else if (instruction.cmd.rd == opcode_index(1, "SAVE")) {
-        throw fatal_error("SAVE TODO");
-      } else if (instruction.cmd.rd == opcode_index(1, "MOV")) {
-        (*registers_set)[instruction.cmd.rs1] = (*registers_set)[instruction.cmd.rs2];
-      } else if (instruction.cmd.rd == opcode_index(1, "OTH1")) {
-        exec_cmd2(text, stack, registers_set, instruction);
+      if (pool && sections.size() > 1) {
+        pool->parallel_for(sections.size(), build);
       } else {
-        throw fatal_error("unknown cmd1");
-      }
-    }
-
-    void exec_cmd0(const data_t& text, data_t& stack, registers_set_t*& registers_set, instruction_t instruction) {
-      if (instruction.cmd.op == opcode_index(0, "SET")) {
-        (*registers_set)[instruction.cmd_set.rd] = instruction.cmd_set.val;
-      } else if (instruction.cmd.op == opcode_index(0, "AND")) {
-        (*registers_set)[instruction.cmd.rd] =
-          (*registers_set)[instruction.cmd.rs1] & (*registers_set)[instruction.cmd.rs2];
-      } else if (instruction.cmd.op == opcode_index(0, "OR")) {
-        (*registers_set)[instruction.cmd.rd] =
-          (*registers_set)[instruction.cmd.rs1] | (*registers_set)[instruction.cmd.rs2];
-      } else if (instruction.cmd.op == opcode_index(0, "XOR")) {
-        (*registers_set)[instruction.cmd.rd] =
-          (*registers_set)[instruction.cmd.rs1] ^ (*registers_set)[instruction.cmd.rs2];
-      } else if (instruction.cmd.op == opcode_index(0, "AND")) {
-        (*registers_set)[instruction.cmd.rd] =
-          (*registers_set)[instruction.cmd.rs1] + (*registers_set)[instruction.cmd.rs2];
-      } else if (instruction.cmd.op == opcode_index(0, "SUB")) {
-        (*registers_set)[instruction.cmd.rd] =
-          (*registers_set)[instruction.cmd.rs1] - (*registers_set)[instruction.cmd.rs2];
-      } else if (instruction.cmd.op == opcode_index(0, "MULT")) {
-        (*registers_set)[instruction.cmd.rd] =
-          (*registers_set)[instruction.cmd.rs1] * (*registers_set)[instruction.cmd.rs2];
-      } else if (instruction.cmd.op == opcode_index(0, "DIV")) {
-        (*registers_set)[instruction.cmd.rd] =
-          (*registers_set)[instruction.cmd.rs1] / (*registers_set)[instruction.cmd.rs2];
-      } else if (instruction.cmd.op == opcode_index(0, "LSH")) {
-        (*registers_set)[instruction.cmd.rd] =
-          (*registers_set)[instruction.cmd.rs1] << (*registers_set)[instruction.cmd.rs2];
-      } else if (instruction.cmd.op == opcode_index(0, "RSH")) {
-        (*registers_set)[instruction.cmd.rd] =
-          (*registers_set)[instruction.cmd.rs1] >> (*registers_set)[instruction.cmd.rs2];
-      } else if (instruction.cmd.op == opcode_index(0, "OTH0")) {
-        exec_cmd1(text, stack, registers_set, instruction);
-      } else {
-        throw fatal_error("unknown cmd0");
+        for (size_t s = 0; s < sections.size(); ++s)
+          build(s);
+      }
+
+      for (const auto& error : errors) {
+        if (error)
+          std::rethrow_exception(error);
       }
+
+      link(instructions, functions, relocations, constants, sections, pool);
     }
+  }
 
-    void process(const data_t& text, const functions_t& functions) {
-      DEBUG_LOGGER_TRACE_EXEC;
 
-      if (functions.find("__start") == functions.end())
-        throw fatal_error("__start not exists");
 
-      data_t stack(0xFFFF, 0);
+  // Потоковая сборка: лексер и парсер работают в своих потоках и передают пачки
+  // лексем и команд через ограниченные очереди spsc_ring_t, генератор
+  // промежуточного кода - в вызывающем потоке. Память под лексемы и команды
+  // ограничена емкостью очередей, а не размером исходника; время сборки
+  // на многоядерной машине стремится ко времени самой медленной стадии.
+  namespace pipeline_n {
+
+    using namespace intermediate_code_generator_n;
 
-      registers_set_t* registers_set = reinterpret_cast<registers_set_t*>(stack.data());
-      (*registers_set)[reg_index("RP")] = 0;
-      (*registers_set)[reg_index("RI")] = functions.at("__start");
-      (*registers_set)[reg_index("RB")] = sizeof(registers_set_t);
-      (*registers_set)[reg_index("RS")] = (*registers_set)[reg_index("RB")];
+    static constexpr size_t chunk_size = 256;
 
-      DEBUG_LOGGER_EXEC("stack frame: '%s'", print_stack(stack, registers_set).c_str());
+    template<typename T>
+    struct chunk_t {
+      std::array<T, chunk_size> items;
+      uint32_t                  size = 0;
+      bool                      last = false;
+    };
 
-      while (true) {
-        instruction_t instruction = *reinterpret_cast<const instruction_t*>(text.data() + (*registers_set)[reg_index("RI")]);
-        exec_cmd0(text, stack, registers_set, instruction);
+    struct options_t {
+      size_t queue = 16;   // пачек в каждой очереди
+    };
+
+    struct cancelled_t { };
+
+    // Первая ошибка любой стадии останавливает остальные.
+    struct control_t {
+      std::atomic<bool>  failed = false;
+      std::exception_ptr error;
+
+      void fail(std::exception_ptr exception) {
+        if (!failed.exchange(true))
+          error = exception;
+      }
 
-        DEBUG_LOGGER_EXEC("instruction: '%s'", print_instruction(instruction).c_str());
-        DEBUG_LOGGER_EXEC("stack frame: '%s'", print_stack(stack, registers_set).c_str());
+      template<typename fn_t>
+      void stage(fn_t&& fn) {
+        try {
+          fn();
+        } catch (const cancelled_t&) {
+        } catch (...) {
+          fail(std::current_exception());
+        }
+      }
+    };
+
+    // Очередь пачек с ожиданием: стадия, которой нечего делать, уступает процессор.
+    template<typename T>
+    class channel_t {
+     public:
+      channel_t(size_t capacity, control_t& control) : ring(capacity), control(control) { }
+
+      void push(const chunk_t<T>& chunk) {
+        while (!ring.push(chunk))
+          wait();
+      }
+
+      void pop(chunk_t<T>& chunk) {
+        while (!ring.pop(chunk))
+          wait();
+      }
 
-        (*registers_set)[reg_index("RI")] += sizeof(instruction_t);
+     private:
+      void wait() {
+        if (control.failed.load(std::memory_order_relaxed))
+          throw cancelled_t();
+        std::this_thread::yield();
       }
 
+      spsc_ring_t<chunk_t<T>> ring;
+      control_t&              control;
+    };
+
+    // Лексемы и команды ссылаются на code, буфер должен пережить все последующие стадии.
+    void process(instructions_t& instructions, functions_t& functions, relocations_t& relocations, constants_t& constants,
+        std::string_view code, const options_t& options = {}) {
+      DEBUG_LOGGER_TRACE_ICG;
+
+      control_t control;
+      channel_t<lexeme_t> lexemes(options.queue, control);
+      channel_t<cmd_t>    cmds(options.queue, control);
+
+      std::thread lexer_thread([&] { control.stage([&] {
+        lexer_t lexer(code);
+        auto chunk = std::make_unique<chunk_t<lexeme_t>>();
+        while (lexer.next(chunk->items[chunk->size])) {
+          if (++chunk->size == chunk_size) {
+            lexemes.push(*chunk);
+            chunk->size = 0;
+          }
+        }
+        chunk->last = true;
+        lexemes.push(*chunk);
+      }); });
+
+      std::thread parser_thread([&] { control.stage([&] {
+        parser_t parser;
+        auto in  = std::make_unique<chunk_t<lexeme_t>>();
+        auto out = std::make_unique<chunk_t<cmd_t>>();
+        do {
+          lexemes.pop(*in);
+          for (size_t i = 0; i < in->size; ++i) {
+            if (parser.push(in->items[i], out->items[out->size]) && ++out->size == chunk_size) {
+              cmds.push(*out);
+              out->size = 0;
+            }
+          }
+        } while (!in->last);
+        parser.finish();
+        out->last = true;
+        cmds.push(*out);
+      }); });
+
+      control.stage([&] {
+        generator_t generator = { instructions, functions, relocations, constants };
+        auto in = std::make_unique<chunk_t<cmd_t>>();
+        do {
+          cmds.pop(*in);
+          for (size_t i = 0; i < in->size; ++i)
+            generator.push(in->items[i]);
+        } while (!in->last);
+        generator.finish();
+      });
+
+      lexer_thread.join();
+      parser_thread.join();
+
+      if (control.error)
+        std::rethrow_exception(control.error);
     }
   }
-}
 
 
-struct interpreter_t {
 
-  struct fatal_error : std::runtime_error {
-    fatal_error(const std::string& msg = "unknown error") : std::runtime_error(msg) { }
-  };
+  namespace decoder_n {
 
-  void exec(const std::string code) {
-    using namespace risc_n;
+    using namespace intermediate_code_generator_n;
 
-    lexical_analyzer_n::lexemes_t lexemes;
-    lexical_analyzer_n::process(lexemes, code);
+    enum handler_t : uint8_t {
+      handler_set,
+      handler_and,
+      handler_or,
+      handler_xor,
+      handler_add,
+      handler_sub,
+      handler_mult,
+      handler_div,
+      handler_lsh,
+      handler_rsh,
+      handler_br,
+      handler_not,
+      handler_load,
+      handler_save,
+      handler_mov,
+      handler_call,
+      handler_ret,
+      handler_load8,
+      handler_load16,
+      handler_load32,
+      handler_save8,
+      handler_save16,
+      handler_save32,
+      handler_yield,
+      handler_const,
+      handler_hcall,
+      handler_hbatch,
+      handler_invalid,
+      // слитые последовательности, появляются только после fuse()
+      handler_shift_in,     // SET RT 8; LSH Rd Rd RT; [SET RT b;] OR Rd Rd RT
+      handler_set64,        // SET Rd b; shift_in...
+      handler_set64_call,   // set64 Rd; CALL Rd
+      handlers_count,
+    };
 
-    syntax_analyzer_n::cmds_str_t cmds_str;
-    syntax_analyzer_n::process(cmds_str, lexemes);
+    struct handler_name_t {
+      handler_t        handler;
+      uint8_t          offset;
+      std::string_view name;
+    };
 
-    intermediate_code_generator_n::instructions_t instructions;
-    intermediate_code_generator_n::functions_t functions;
-    intermediate_code_generator_n::process(instructions, functions, cmds_str);
+    static constexpr auto handlers_names = std::to_array<handler_name_t>({
+      { handler_set,  0, "SET"  },
+      { handler_and,  0, "AND"  },
+      { handler_or,   0, "OR"   },
+      { handler_xor,  0, "XOR"  },
+      { handler_add,  0, "ADD"  },
+      { handler_sub,  0, "SUB"  },
+      { handler_mult, 0, "MULT" },
+      { handler_div,  0, "DIV"  },
+      { handler_lsh,  0, "LSH"  },
+      { handler_rsh,  0, "RSH"  },
+      { handler_br,   1, "BR"   },
+      { handler_not,  1, "NOT"  },
+      { handler_load, 1, "LOAD" },
+      { handler_save, 1, "SAVE" },
+      { handler_mov,  1, "MOV"  },
+      { handler_call, 2, "CALL" },
+      { handler_ret,  3, "RET"  },
+      { handler_load8,  1, "LOAD8"  },
+      { handler_load16, 1, "LOAD16" },
+      { handler_load32, 1, "LOAD32" },
+      { handler_save8,  1, "SAVE8"  },
+      { handler_save16, 1, "SAVE16" },
+      { handler_save32, 1, "SAVE32" },
+      { handler_yield,  3, "YIELD"  },
+      { handler_const,  0, "CONST"  },
+      { handler_hcall,  1, "HCALL"  },
+      { handler_hbatch, 1, "HBATCH" },
+    });
+
+    // Операнды нормализованы: rd - изменяемый регистр, rs1/rs2 - источники,
+    // val - непосредственное значение SET или место в пуле CONST (imm - значение
+    // из пула). raw нужен только для печати.
+    // У слитых инструкций length - число исходных инструкций, imm - значение Rd,
+    // val - значение RT после последовательности.
+    struct decoded_instruction_t {
+      uint8_t       handler;
+      uint8_t       rd;
+      uint8_t       rs1;
+      uint8_t       rs2;
+      uint8_t       val;
+      uint8_t       length = 1;
+      instruction_t raw;
+      reg_value_t   imm = 0;
+    };
 
-    utils_n::data_t text;
-    code_generator_n::process(text, instructions);
+    using decoded_text_t = std::vector<decoded_instruction_t>;
 
-    executor_n::process(text, functions);
-  }
-};
+    enum operand_t : uint8_t {
+      operand_rd  = 1 << 0,
+      operand_rs1 = 1 << 1,
+      operand_rs2 = 1 << 2,
+    };
 
-int main() {
-  std::string code = R"ASM(
-    FUNCTION f1
-      MULT R1 R1 R2
-      MULT R4 R1 R5
-    RET
+    static constexpr std::array<uint8_t, handlers_count> handlers_operands = {
+      operand_rd,                                // SET
+      operand_rd | operand_rs1 | operand_rs2,    // AND
+      operand_rd | operand_rs1 | operand_rs2,    // OR
+      operand_rd | operand_rs1 | operand_rs2,    // XOR
+      operand_rd | operand_rs1 | operand_rs2,    // ADD
+      operand_rd | operand_rs1 | operand_rs2,    // SUB
+      operand_rd | operand_rs1 | operand_rs2,    // MULT
+      operand_rd | operand_rs1 | operand_rs2,    // DIV
+      operand_rd | operand_rs1 | operand_rs2,    // LSH
+      operand_rd | operand_rs1 | operand_rs2,    // RSH
+      operand_rd | operand_rs1,                  // BR
+      operand_rd | operand_rs1,                  // NOT
+      operand_rd | operand_rs1,                  // LOAD
+      operand_rd | operand_rs1,                  // SAVE
+      operand_rd | operand_rs1,                  // MOV
+      operand_rs1,                               // CALL
+      0,                                         // RET
+      operand_rd | operand_rs1,                  // LOAD8
+      operand_rd | operand_rs1,                  // LOAD16
+      operand_rd | operand_rs1,                  // LOAD32
+      operand_rd | operand_rs1,                  // SAVE8
+      operand_rd | operand_rs1,                  // SAVE16
+      operand_rd | operand_rs1,                  // SAVE32
+      0,                                         // YIELD
+      operand_rd,                                // CONST
+      operand_rd | operand_rs1,                  // HCALL
+      operand_rd | operand_rs1,                  // HBATCH
+      0,                                         // invalid
+      operand_rd | operand_rs1,                  // shift_in
+      operand_rd,                                // set64
+      operand_rd | operand_rs1,                  // set64_call
+    };
 
-    FUNCTION square
-      XOR R2 R3 R4
-    RET
+    static_assert([] {
+      for (size_t i = 0; i < handlers_names.size(); ++i) {
+        if (handlers_names[i].handler != i)
+          return false;
+      }
+      return handlers_names.size() == handler_invalid;
+    }(), "handlers_names must be indexed by handler");
+
+    // rd - результат, а не источник (у BR и SAVE rd только читается).
+    constexpr bool writes_rd(uint8_t handler) {
+      switch (handler) {
+        case handler_br:
+        case handler_save:
+        case handler_save8:
+        case handler_save16:
+        case handler_save32:
+        case handler_call:
+        case handler_ret:
+        case handler_yield:
+        case handler_invalid:
+          return false;
+        default:
+          return true;
+      }
+    }
 
-    FUNCTION main
-      SET R1 72623859790382856
-      MOV R2 R1
+    // Ширина доступа LOAD/SAVE в байтах, 0 - не обращение к памяти.
+    constexpr size_t memory_width(uint8_t handler) {
+      switch (handler) {
+        case handler_load8:
+        case handler_save8:
+          return 1;
+        case handler_load16:
+        case handler_save16:
+          return 2;
+        case handler_load32:
+        case handler_save32:
+          return 4;
+        case handler_load:
+        case handler_save:
+          return 8;
+        default:
+          return 0;
+      }
+    }
+
+    // HCALL/HBATCH: обработчик хоста читает регистры фрейма и любую память.
+    constexpr bool calls_host(uint8_t handler) {
+      return handler == handler_hcall || handler == handler_hbatch;
+    }
+
+    bool uses_register(const decoded_instruction_t& instruction, uint8_t reg) {
+      auto operands = handlers_operands[instruction.handler];
+      return (operands & operand_rd  && instruction.rd  == reg)
+          || (operands & operand_rs1 && instruction.rs1 == reg)
+          || (operands & operand_rs2 && instruction.rs2 == reg);
+    }
+
+    // handlers_lookup[offset][index]
+    using handlers_lookup_t = std::array<std::array<uint8_t, 16>, 4>;
+
+    static constexpr handlers_lookup_t handlers_lookup = [] {
+      handlers_lookup_t lookup = {};
+      for (auto& row : lookup)
+        row.fill(handler_invalid);
+      for (const auto& handler_name : handlers_names) {
+        lookup[handler_name.offset][opcode_index(handler_name.offset, handler_name.name)] = handler_name.handler;
+      }
+      return lookup;
+    }();
+
+    decoded_instruction_t decode(instruction_t instruction) {
+      const auto& lookup = handlers_lookup;
+      auto oth0 = opcode_index_c(0, "OTH0");
+      auto oth1 = opcode_index_c(1, "OTH1");
+      auto oth2 = opcode_index_c(2, "OTH2");
+
+      decoded_instruction_t decoded = { handler_invalid, 0, 0, 0, 0, 1, instruction };
+      auto cmd = instruction.cmd;
+
+      if (instruction.cmd_set.op == opcode_index_c(0, "SET") || instruction.cmd_set.op == opcode_index_c(0, "CONST")) {
+        decoded.handler = lookup[0][instruction.cmd_set.op];
+        decoded.rd      = instruction.cmd_set.rd;
+        decoded.val     = instruction.cmd_set.val;
+      } else if (cmd.op != oth0) {
+        decoded.handler = lookup[0][cmd.op];
+        decoded.rd      = cmd.rd;
+        decoded.rs1     = cmd.rs1;
+        decoded.rs2     = cmd.rs2;
+      } else if (cmd.rd != oth1) {
+        decoded.handler = lookup[1][cmd.rd];
+        decoded.rd      = cmd.rs1;
+        decoded.rs1     = cmd.rs2;
+      } else if (cmd.rs1 != oth2) {
+        decoded.handler = lookup[2][cmd.rs1];
+        decoded.rs1     = cmd.rs2;
+      } else {
+        decoded.handler = lookup[3][cmd.rs2];
+      }
+
+      return decoded;
+    }
+
+    constexpr std::string_view handler_name(uint8_t handler) {
+      switch (handler) {
+        case handler_invalid:    return "INVALID";
+        case handler_shift_in:   return "SHIFT_IN";
+        case handler_set64:      return "SET64";
+        case handler_set64_call: return "SET64_CALL";
+        default:                 return handlers_names[handler].name;
+      }
+    }
+
+    instruction_t encode(const decoded_instruction_t& decoded) {
+      if (decoded.handler >= handler_invalid)
+        throw fatal_error("unknown handler");
+
+      const auto& handler_name = handlers_names[decoded.handler];
+      auto index = opcode_index(handler_name.offset, handler_name.name);
+      auto oth0  = opcode_index_c(0, "OTH0");
+      auto oth1  = opcode_index_c(1, "OTH1");
+      auto oth2  = opcode_index_c(2, "OTH2");
+
+      instruction_t instruction;
+      if (decoded.handler == handler_set || decoded.handler == handler_const) {
+        instruction.cmd_set = { index, decoded.rd, decoded.val };
+      } else if (handler_name.offset == 0) {
+        instruction.cmd = { index, decoded.rd, decoded.rs1, decoded.rs2 };
+      } else if (handler_name.offset == 1) {
+        instruction.cmd = { oth0, index, decoded.rd, decoded.rs1 };
+      } else if (handler_name.offset == 2) {
+        instruction.cmd = { oth0, oth1, index, decoded.rs1 };
+      } else {
+        instruction.cmd = { oth0, oth1, oth2, index };
+      }
+      return instruction;
+    }
+
+    // data - пул констант: CONST получает значение сразу, CONST за пределами
+    // пула - неизвестная команда.
+    void process(decoded_text_t& decoded, text_t text, text_t data) {
+      decoded.resize(text.size() / sizeof(instruction_t));
+      for (size_t i = 0; i < decoded.size(); ++i) {
+        instruction_t instruction;
+        memcpy(&instruction.value, text.data() + i * sizeof(instruction_t), sizeof(instruction_t));
+        decoded[i] = decode(instruction);
+        if (decoded[i].handler != handler_const)
+          continue;
+        if ((decoded[i].val + 1) * sizeof(reg_value_t) > data.size())
+          decoded[i].handler = handler_invalid;
+        else
+          memcpy(&decoded[i].imm, data.data() + decoded[i].val * sizeof(reg_value_t), sizeof(reg_value_t));
+      }
+    }
+
+    // Длина shift_in с позиции index для регистра rd, 0 - не совпало.
+    // Второй SET RT пропускает оптимизатор, если байт равен 8.
+    size_t match_shift_in(const decoded_text_t& decoded, size_t index, uint8_t rd, uint8_t& byte) {
+      static constexpr uint8_t rt = reg_index_c("RT");
+
+      auto is = [&](size_t i, uint8_t handler, uint8_t d, uint8_t s1, uint8_t s2) {
+        if (i >= decoded.size())
+          return false;
+        const auto& instruction = decoded[i];
+        return instruction.handler == handler && instruction.rd == d
+          && (handler == handler_set || (instruction.rs1 == s1 && instruction.rs2 == s2));
+      };
+
+      if (!is(index, handler_set, rt, 0, 0) || decoded[index].val != 8 || !is(index + 1, handler_lsh, rd, rd, rt))
+        return 0;
+      if (is(index + 2, handler_set, rt, 0, 0) && is(index + 3, handler_or, rd, rd, rt)) {
+        byte = decoded[index + 2].val;
+        return 4;
+      }
+      if (is(index + 2, handler_or, rd, rd, rt)) {
+        byte = 8;
+        return 3;
+      }
+      return 0;
+    }
+
+    // Слитая инструкция занимает место первой из последовательности, остальные
+    // остаются на своих местах: вход в середину последовательности (адрес
+    // возврата, вычисленный переход) исполняет исходные инструкции.
+    void fuse(decoded_text_t& decoded) {
+      static constexpr uint8_t ri = reg_index_c("RI");
+      static constexpr uint8_t rt = reg_index_c("RT");
+
+      for (size_t i = 0; i < decoded.size(); ++i) {
+        auto& first = decoded[i];
+        if (first.handler != handler_set || first.rd == ri)
+          continue;
+
+        uint8_t byte;
+        if (first.rd == rt) {
+          auto rd = i + 1 < decoded.size() ? decoded[i + 1].rd : rt;
+          if (rd == rt || rd == ri)
+            continue;
+          if (auto length = match_shift_in(decoded, i, rd, byte)) {
+            first.handler = handler_shift_in;
+            first.rd      = rd;
+            first.rs1     = rd;
+            first.val     = byte;
+            first.length  = length;
+          }
+          continue;
+        }
+
+        reg_value_t value = first.val;
+        uint8_t rt_value = 0;
+        size_t length = 1;
+        while (auto size = match_shift_in(decoded, i + length, first.rd, byte)) {
+          if (length + size > std::numeric_limits<uint8_t>::max())
+            break;
+          value = static_cast<reg_value_t>(static_cast<uint64_t>(value) << 8) | byte;
+          rt_value = byte;
+          length += size;
+        }
+
+        if (length == 1)
+          continue;
+
+        first.handler = handler_set64;
+        first.imm     = value;
+        first.val     = rt_value;
+        first.length  = length;
+
+        if (i + length < decoded.size() && decoded[i + length].handler == handler_call
+            && decoded[i + length].rs1 == first.rd && length + 1 <= std::numeric_limits<uint8_t>::max()) {
+          first.handler = handler_set64_call;
+          first.rs1     = first.rd;
+          ++first.length;
+        }
+      }
+    }
+  }
+
+
+
+  namespace code_optimizer_n {
+
+    using namespace decoder_n;
+
+    struct options_t {
+      uint8_t level        = 1;   // 0 - без оптимизаций (-O0), 1 - peephole (-O1)
+      size_t  inline_limit = 8;   // длина встраиваемой листовой функции, 0 - без встраивания
+    };
+
+    struct stats_t {
+      size_t redundant_set = 0;   // SET значения, которое уже лежит в регистре
+      size_t const_fold    = 0;   // операция над известными значениями заменена на SET
+      size_t self_xor      = 0;   // XOR/SUB Rd Ra Ra заменена на SET Rd 0
+      size_t mov_chain     = 0;   // MOV переписан на источник цепочки копий или удален
+      size_t dead_store    = 0;   // запись, перезаписанная до чтения
+      size_t inlined       = 0;   // встроенные вызовы листовых функций
+      size_t before        = 0;   // инструкций до оптимизации
+      size_t after         = 0;   // инструкций после оптимизации
+
+      std::vector<std::string> inline_sites;   // "вызывающая -> вызванная (#номер вызова)"
+    };
+
+    std::string print_stats(const stats_t& stats) {
+      std::stringstream ss;
+      ss << "redundant_set: " << stats.redundant_set << std::endl
+        << "const_fold:    " << stats.const_fold    << std::endl
+        << "self_xor:      " << stats.self_xor      << std::endl
+        << "mov_chain:     " << stats.mov_chain     << std::endl
+        << "dead_store:    " << stats.dead_store    << std::endl
+        << "inlined:       " << stats.inlined       << std::endl;
+      for (const auto& site : stats.inline_sites)
+        ss << "  " << site << std::endl;
+      ss << "instructions:  " << stats.before << " -> " << stats.after << std::endl;
+      return ss.str();
+    }
+
+    static constexpr uint8_t reg_ri = reg_index_c("RI");
+    static constexpr uint8_t reg_rp = reg_index_c("RP");
+    static constexpr uint8_t reg_rb = reg_index_c("RB");
+    static constexpr uint8_t reg_rs = reg_index_c("RS");
+    static constexpr uint8_t reg_rt = reg_index_c("RT");
+
+    // Поток между проходами: инструкции, адреса ADDRESS (размер последовательности
+    // зависит от итоговой раскладки) и метки начала функций.
+    struct item_t {
+      enum kind_t : uint8_t {
+        instruction,
+        address,
+        function,
+      };
+
+      kind_t                kind;
+      bool                  removed;
+      decoded_instruction_t decoded;   // instruction; у address - первая инструкция, CONST - адрес в пуле
+      uint8_t               rd;        // address
+      size_t                size;      // address: длина последовательности
+      std::string_view      name;      // address, function
+    };
+
+    using items_t = std::vector<item_t>;
+
+    // Известные значения регистров в линейном участке.
+    struct values_t {
+      std::array<std::optional<reg_value_t>, 16> known;
+      std::array<uint8_t, 16>                    copy;   // copy[r] - регистр, копией которого является r
+
+      values_t() {
+        reset();
+      }
+
+      void reset() {
+        known.fill(std::nullopt);
+        for (uint8_t reg = 0; reg < copy.size(); ++reg)
+          copy[reg] = reg;
+      }
+
+      void forget(uint8_t reg) {
+        known[reg].reset();
+        for (uint8_t other = 0; other < copy.size(); ++other) {
+          if (copy[other] == reg)
+            copy[other] = other;
+        }
+        copy[reg] = reg;
+      }
+
+      void set(uint8_t reg, reg_value_t value) {
+        forget(reg);
+        known[reg] = value;
+      }
+
+      void assign(uint8_t reg, uint8_t source) {
+        forget(reg);
+        known[reg] = known[source];
+        copy[reg]  = source;
+      }
+    };
+
+    std::optional<reg_value_t> fold(uint8_t handler, std::optional<reg_value_t> a, std::optional<reg_value_t> b) {
+      // 0 поглощает результат независимо от второго операнда
+      if ((handler == handler_and || handler == handler_mult) && (a == 0 || b == 0))
+        return 0;
+      if ((handler == handler_lsh || handler == handler_rsh) && a == 0)
+        return 0;
+
+      if (!a || !b)
+        return std::nullopt;
+
+      auto ua = static_cast<reg_uvalue_t>(*a);
+      auto ub = static_cast<reg_uvalue_t>(*b);
+      switch (handler) {
+        case handler_and:  return *a & *b;
+        case handler_or:   return *a | *b;
+        case handler_xor:  return *a ^ *b;
+        case handler_add:  return static_cast<reg_value_t>(ua + ub);
+        case handler_sub:  return static_cast<reg_value_t>(ua - ub);
+        case handler_mult: return static_cast<reg_value_t>(ua * ub);
+        case handler_div:
+          if (!*b || (*a == std::numeric_limits<reg_value_t>::min() && *b == -1))
+            return std::nullopt;
+          return *a / *b;
+        case handler_lsh:
+          return static_cast<reg_value_t>(ua << (*b & 63));
+        case handler_rsh:
+          return *a >> (*b & 63);
+        default:
+          return std::nullopt;
+      }
+    }
+
+    void make_set(decoded_instruction_t& decoded, uint8_t rd, uint8_t value) {
+      decoded = { handler_set, rd, 0, 0, value, 1, {} };
+    }
+
+    // Прямой проход: распространение констант и копий.
+    bool forward(items_t& items, size_t begin, size_t end, const constants_t& constants, stats_t& stats) {
+      bool changed = false;
+      values_t values;
+
+      for (size_t i = begin; i < end; ++i) {
+        auto& item = items[i];
+        if (item.removed)
+          continue;
+
+        if (item.kind == item_t::address) {
+          values.forget(item.rd);
+          values.forget(reg_rt);
+          continue;
+        }
+
+        auto& decoded = item.decoded;
+        if (uses_register(decoded, reg_ri)) {
+          values.reset();
+          continue;
+        }
+
+        switch (decoded.handler) {
+          case handler_set:
+            if (values.known[decoded.rd] == decoded.val) {
+              item.removed = true;
+              ++stats.redundant_set;
+              changed = true;
+            } else {
+              values.set(decoded.rd, decoded.val);
+            }
+            break;
+
+          case handler_const:
+            if (decoded.val >= constants.size()) {
+              values.forget(decoded.rd);
+            } else if (values.known[decoded.rd] == constants[decoded.val]) {
+              item.removed = true;
+              ++stats.redundant_set;
+              changed = true;
+            } else {
+              values.set(decoded.rd, constants[decoded.val]);
+            }
+            break;
+
+          case handler_mov: {
+            auto source = values.copy[decoded.rs1];
+            if (source != decoded.rs1) {
+              decoded.rs1 = source;
+              ++stats.mov_chain;
+              changed = true;
+            }
+            if (decoded.rd == source || values.copy[decoded.rd] == source) {
+              item.removed = true;
+              ++stats.mov_chain;
+              changed = true;
+            } else if (values.known[source] && fits_set(*values.known[source])) {
+              make_set(decoded, decoded.rd, *values.known[source]);
+              values.set(decoded.rd, decoded.val);
+              ++stats.const_fold;
+              changed = true;
+            } else {
+              values.assign(decoded.rd, source);
+            }
+            break;
+          }
+
+          case handler_not: {
+            auto value = values.known[decoded.rs1];
+            if (value && values.known[decoded.rd] == ~*value) {
+              item.removed = true;
+              ++stats.redundant_set;
+              changed = true;
+            } else if (value && fits_set(~*value)) {
+              make_set(decoded, decoded.rd, ~*value);
+              values.set(decoded.rd, decoded.val);
+              ++stats.const_fold;
+              changed = true;
+            } else if (value) {
+              values.set(decoded.rd, ~*value);
+            } else {
+              values.forget(decoded.rd);
+            }
+            break;
+          }
+
+          case handler_and:
+          case handler_or:
+          case handler_xor:
+          case handler_add:
+          case handler_sub:
+          case handler_mult:
+          case handler_div:
+          case handler_lsh:
+          case handler_rsh: {
+            std::optional<reg_value_t> value;
+            if ((decoded.handler == handler_xor || decoded.handler == handler_sub) && decoded.rs1 == decoded.rs2) {
+              value = 0;
+              if (values.known[decoded.rd] != 0) {
+                make_set(decoded, decoded.rd, 0);
+                values.set(decoded.rd, 0);
+                ++stats.self_xor;
+                changed = true;
+                break;
+              }
+            } else {
+              value = fold(decoded.handler, values.known[decoded.rs1], values.known[decoded.rs2]);
+            }
+
+            if (value && values.known[decoded.rd] == value) {
+              item.removed = true;
+              ++stats.redundant_set;
+              changed = true;
+            } else if (value && fits_set(*value)) {
+              make_set(decoded, decoded.rd, *value);
+              values.set(decoded.rd, decoded.val);
+              ++stats.const_fold;
+              changed = true;
+            } else if (value) {
+              values.set(decoded.rd, *value);
+            } else {
+              values.forget(decoded.rd);
+            }
+            break;
+          }
+
+          default:
+            // CALL, RET, BR, LOAD*, SAVE*, HCALL, HBATCH: о регистрах ничего не известно
+            values.reset();
+            break;
+        }
+      }
+
+      return changed;
+    }
+
+    // Обратный проход: удаление записей, перезаписанных до чтения.
+    // После RET фрейм не читается, кроме корневого, поэтому мертвым
+    // там считается только RT.
+    bool backward(items_t& items, size_t begin, size_t end, stats_t& stats) {
+      static constexpr uint16_t all = 0xFFFF;
+
+      bool changed = false;
+      uint16_t live = all;
+
+      for (size_t i = end; i-- > begin; ) {
+        auto& item = items[i];
+        if (item.removed)
+          continue;
+
+        if (item.kind == item_t::address) {
+          live &= ~(1u << item.rd);
+          continue;
+        }
+
+        const auto& decoded = item.decoded;
+        if (decoded.handler == handler_ret) {
+          live = all & ~(1u << reg_rt);
+          continue;
+        }
+
+        if (uses_register(decoded, reg_ri) || !writes_rd(decoded.handler) || memory_width(decoded.handler)
+            || calls_host(decoded.handler)) {
+          live = all;
+          continue;
+        }
+
+        if (!(live & (1u << decoded.rd)) && decoded.handler != handler_div) {
+          item.removed = true;
+          ++stats.dead_store;
+          changed = true;
+          continue;
+        }
+
+        auto operands = handlers_operands[decoded.handler];
+        live &= ~(1u << decoded.rd);
+        if (operands & operand_rs1)
+          live |= 1u << decoded.rs1;
+        if (operands & operand_rs2)
+          live |= 1u << decoded.rs2;
+      }
+
+      return changed;
+    }
+
+    items_t make_items(const instructions_t& instructions, const functions_t& functions, const relocations_t& relocations) {
+      std::vector<std::pair<size_t, std::string_view>> markers;
+      for (const auto& [name, offset] : functions)
+        markers.emplace_back(offset / sizeof(instruction_t), name);
+      std::stable_sort(markers.begin(), markers.end(),
+          [](const auto& a, const auto& b) { return a.first < b.first; });
+
+      items_t items;
+      items.reserve(instructions.size() + markers.size());
+
+      size_t m = 0;
+      size_t r = 0;
+      for (size_t i = 0; i <= instructions.size(); ) {
+        for (; m < markers.size() && markers[m].first == i; ++m)
+          items.push_back({ item_t::function, false, {}, 0, 0, markers[m].second });
+
+        if (i == instructions.size())
+          break;
+
+        if (r < relocations.size() && relocations[r].index == i) {
+          items.push_back({ item_t::address, false, decode(instructions[i]), relocations[r].rd, 1, relocations[r].name });
+          i += relocations[r].size;
+          ++r;
+          continue;
+        }
+
+        items.push_back({ item_t::instruction, false, decode(instructions[i]), 0, 0, {} });
+        ++i;
+      }
+
+      return items;
+    }
+
+    // Раскладка: адреса функций зависят от длины последовательностей ADDRESS
+    // (ADDRESS через пул - всегда одна CONST), а длины - от адресов. Длины только растут от минимальных, поэтому
+    // итерации сходятся.
+    void layout(items_t& items, functions_t& functions) {
+      bool changed = true;
+      while (changed) {
+        size_t offset = 0;
+        for (const auto& item : items) {
+          if (item.removed)
+            continue;
+          if (item.kind == item_t::function)
+            functions.find(item.name)->second = offset * sizeof(instruction_t);
+          else
+            offset += item.kind == item_t::address ? item.size : 1;
+        }
+
+        changed = false;
+        for (auto& item : items) {
+          if (item.kind != item_t::address)
+            continue;
+          if (item.decoded.handler == handler_const)
+            continue;
+          auto size = macro_set_size(functions.find(item.name)->second);
+          if (size != item.size) {
+            item.size = size;
+            changed = true;
+          }
+        }
+      }
+    }
+
+    uint16_t reads_mask(const decoded_instruction_t& decoded) {
+      auto operands = handlers_operands[decoded.handler];
+      uint16_t mask = 0;
+      if (operands & operand_rd && !writes_rd(decoded.handler))
+        mask |= 1u << decoded.rd;
+      if (operands & operand_rs1)
+        mask |= 1u << decoded.rs1;
+      if (operands & operand_rs2)
+        mask |= 1u << decoded.rs2;
+      return mask;
+    }
+
+    uint16_t writes_mask(const decoded_instruction_t& decoded) {
+      return handlers_operands[decoded.handler] & operand_rd && writes_rd(decoded.handler) ? 1u << decoded.rd : 0;
+    }
+
+    // Живые регистры перед инструкцией по живым после нее. В отличие от backward
+    // регистры функции - ее локальные данные: вызванная функция их не читает, поэтому
+    // CALL читает только регистр с адресом, а LOAD*/SAVE* не обращаются к ним через
+    // память. После RET регистры мертвы. Корневая функция (__start и код до первой
+    // функции) отдает регистры наружу и может читать свой фрейм, для нее - как в backward.
+    // branch - живые на метках функции: BR может перейти на любую из них.
+    uint16_t live_before(const decoded_instruction_t& decoded, uint16_t live, bool root, uint16_t branch) {
+      static constexpr uint16_t all = 0xFFFF;
+
+      if (uses_register(decoded, reg_ri) || calls_host(decoded.handler))
+        return all;
+      switch (decoded.handler) {
+        case handler_ret:
+          return root ? all & ~(1u << reg_rt) : 0;
+        case handler_call:
+          return root ? all : live | 1u << decoded.rs1;
+        case handler_br:
+          return live | branch | reads_mask(decoded);
+        default:
+          break;
+      }
+      if ((!writes_rd(decoded.handler) && !memory_width(decoded.handler)) || (root && memory_width(decoded.handler)))
+        return all;
+      return (live & ~writes_mask(decoded)) | reads_mask(decoded);
+    }
+
+    // Живые на метках функции [begin, end) - неподвижная точка по переходам BR.
+    uint16_t labels_live(const items_t& items, size_t begin, size_t end, bool root) {
+      uint16_t branch = 0;
+      for (;;) {
+        uint16_t live = 0xFFFF;
+        uint16_t labels = branch;
+        for (size_t i = end; i-- > begin; ) {
+          const auto& item = items[i];
+          if (item.kind == item_t::function)
+            labels |= live;
+          else if (item.kind == item_t::address)
+            live &= ~(1u << item.rd);
+          else
+            live = live_before(item.decoded, live, root, branch);
+        }
+        if (labels == branch)
+          return branch;
+        branch = labels;
+      }
+    }
+
+    // Листовая функция: линейное тело до первого RET без вызовов, переходов и регистров фрейма.
+    struct leaf_t {
+      std::vector<decoded_instruction_t> body;
+      uint16_t                           used   = 0;       // регистры тела
+      uint16_t                           args   = 0;       // читаются до записи - аргументы из фрейма
+      bool                               memory = false;   // LOAD*/SAVE* в теле
+    };
+
+    constexpr bool inlinable(uint8_t handler) {
+      switch (handler) {
+        case handler_set:
+        case handler_const:
+        case handler_and:
+        case handler_or:
+        case handler_xor:
+        case handler_add:
+        case handler_sub:
+        case handler_mult:
+        case handler_div:
+        case handler_lsh:
+        case handler_rsh:
+        case handler_not:
+        case handler_mov:
+          return true;
+        default:
+          return memory_width(handler) != 0;
+      }
+    }
+
+    std::unordered_map<std::string_view, leaf_t> find_leaves(const items_t& items, size_t limit) {
+      static constexpr uint16_t frame = 1u << reg_ri | 1u << reg_rp | 1u << reg_rb | 1u << reg_rs;
+
+      std::unordered_map<std::string_view, leaf_t> leaves;
+      for (size_t i = 0; i < items.size(); ++i) {
+        if (items[i].kind != item_t::function || is_label(items[i].name) || items[i].name == "__start")
+          continue;
+
+        leaf_t leaf;
+        uint16_t written = 0;
+        for (size_t j = i + 1; j < items.size() && items[j].kind == item_t::instruction; ++j) {
+          const auto& decoded = items[j].decoded;
+          if (decoded.handler == handler_ret) {
+            leaves.emplace(items[i].name, std::move(leaf));
+            break;
+          }
+
+          auto reads  = reads_mask(decoded);
+          auto writes = writes_mask(decoded);
+          if (!inlinable(decoded.handler) || (reads | writes) & frame || leaf.body.size() == limit)
+            break;
+          leaf.args   |= reads & ~written;
+          leaf.used   |= reads | writes;
+          leaf.memory |= memory_width(decoded.handler) != 0;
+          written     |= writes;
+          leaf.body.push_back(decoded);
+        }
+      }
+      return leaves;
+    }
+
+    // Встраивание листовых функций на местах ADDRESS Ra f; CALL Ra.
+    // Регистры вызванной функции - ее фрейм в памяти стека, и после RET он не читается:
+    // тело переименовывается в регистры вызывающей, мертвые после вызова, а аргументы
+    // (регистры, которые тело читает до записи) загружаются из слотов нового фрейма
+    // по адресу RS + 8 * r. Мертвыми после RET считаются все регистры функции,
+    // кроме корневой (__start и код до первой функции), у которой живы все, кроме RT.
+    // Число исполняемых инструкций не растет: 3 инструкции на аргумент окупаются CALL, RET и
+    // ставшим ненужным ADDRESS.
+    void inline_leaves(items_t& items, const options_t& options, stats_t& stats) {
+      static constexpr uint16_t all   = 0xFFFF;
+      static constexpr uint16_t frame = 1u << reg_ri | 1u << reg_rp | 1u << reg_rb | 1u << reg_rs;
+
+      if (!options.inline_limit)
+        return;
+
+      auto leaves = find_leaves(items, options.inline_limit);
+      if (leaves.empty())
+        return;
+
+      // функция каждого элемента, номер места вызова в ней и живые на ее метках
+      std::vector<std::string_view> owners(items.size());
+      std::vector<size_t> sites(items.size());
+      std::vector<uint16_t> branches(items.size());
+      std::string_view owner;
+      size_t site  = 0;
+      size_t begin = 0;
+      for (size_t i = 0; i <= items.size(); ++i) {
+        if (i == items.size() || (items[i].kind == item_t::function && !is_label(items[i].name))) {
+          auto branch = labels_live(items, begin, i, owner.empty() || owner == "__start");
+          std::fill(branches.begin() + begin, branches.begin() + i, branch);
+          if (i == items.size())
+            break;
+          owner = items[i].name;
+          site  = 0;
+          begin = i;
+        }
+        owners[i] = owner;
+        if (items[i].kind == item_t::instruction && items[i].decoded.handler == handler_call)
+          sites[i] = site++;
+      }
+
+      items_t result;
+      result.reserve(items.size());
+      std::vector<std::string> inlined;
+      uint16_t live = all;
+
+      for (size_t i = items.size(); i-- > 0; ) {
+        const auto& item = items[i];
+        if (item.kind == item_t::function) {
+          if (!is_label(item.name))
+            live = all;
+          result.push_back(item);
+          continue;
+        }
+        if (item.kind == item_t::address) {
+          live &= ~(1u << item.rd);
+          result.push_back(item);
+          continue;
+        }
+
+        const auto& decoded = item.decoded;
+        auto root = owners[i].empty() || owners[i] == "__start";
+        auto branch = branches[i];
+
+        const leaf_t* leaf = nullptr;
+        if (decoded.handler == handler_call && i > 0 && items[i - 1].kind == item_t::address
+            && items[i - 1].rd == decoded.rs1 && !is_label(items[i - 1].name)) {
+          if (auto it = leaves.find(items[i - 1].name); it != leaves.end())
+            leaf = &it->second;
+        }
+        if (!leaf) {
+          live = live_before(decoded, live, root, branch);
+          result.push_back(item);
+          continue;
+        }
+
+        // регистры для тела: мертвые после вызова, по возможности те же
+        auto keep_address = (live & (1u << decoded.rs1)) != 0;
+        auto args = std::popcount(leaf->args);
+        uint16_t free = ~live & ~frame;
+        if (keep_address)
+          free &= ~(1u << decoded.rs1);
+        if (args)
+          free &= ~(1u << reg_rt);
+
+        std::array<uint8_t, 16> map = {};
+        uint16_t pending = 0;
+        for (uint8_t reg = 0; reg < 16; ++reg) {
+          if (!(leaf->used & (1u << reg)))
+            continue;
+          if (free & (1u << reg)) {
+            map[reg] = reg;
+            free &= ~(1u << reg);
+          } else {
+            pending |= 1u << reg;
+          }
+        }
+        for (uint8_t reg = 0; reg < 16 && free; ++reg) {
+          if (pending & (1u << reg)) {
+            map[reg] = std::countr_zero(free);
+            free &= free - 1;
+            pending &= ~(1u << reg);
+          }
+        }
+
+        if (pending || 3 * args > 2 + !keep_address || (args && live & (1u << reg_rt))) {
+          live = live_before(decoded, live, root, branch);
+          result.push_back(item);
+          continue;
+        }
+
+        // элементы кладутся в обратном порядке
+        for (auto body = leaf->body.rbegin(); body != leaf->body.rend(); ++body) {
+          auto renamed = *body;
+          auto operands = handlers_operands[renamed.handler];
+          if (operands & operand_rd)
+            renamed.rd = map[renamed.rd];
+          if (operands & operand_rs1)
+            renamed.rs1 = map[renamed.rs1];
+          if (operands & operand_rs2)
+            renamed.rs2 = map[renamed.rs2];
+          live = live_before(renamed, live, root, branch);
+          result.push_back({ item_t::instruction, false, renamed, 0, 0, {} });
+        }
+
+        for (uint8_t reg = 16; reg-- > 0; ) {
+          if (!(leaf->args & (1u << reg)))
+            continue;
+          result.push_back({ item_t::instruction, false, { handler_load, map[reg], reg_rt, 0, 0, 1, {} }, 0, 0, {} });
+          result.push_back({ item_t::instruction, false, { handler_add, reg_rt, reg_rs, reg_rt, 0, 1, {} }, 0, 0, {} });
+          result.push_back({ item_t::instruction, false, {}, 0, 0, {} });
+          make_set(result.back().decoded, reg_rt, 8 * reg);
+          live = (live & ~(1u << map[reg])) | 1u << reg_rs;
+        }
+
+        --i;
+        if (keep_address) {
+          live &= ~(1u << items[i].rd);
+          result.push_back(items[i]);
+        }
+
+        std::stringstream ss;
+        ss << (owners[i].empty() ? "<root>" : owners[i]) << " -> " << items[i].name << " (#" << sites[i + 1] << ")";
+        DEBUG_LOGGER_OPT("inline: %s", ss.str().c_str());
+        inlined.push_back(ss.str());
+      }
+
+      std::reverse(result.begin(), result.end());
+      items = std::move(result);
+
+      stats.inlined += inlined.size();
+      stats.inline_sites.insert(stats.inline_sites.end(), inlined.rbegin(), inlined.rend());
+    }
+
+    void process(instructions_t& instructions, functions_t& functions, relocations_t& relocations, constants_t& constants,
+        stats_t& stats, const options_t& options = {}) {
+      DEBUG_LOGGER_TRACE_OPT;
+
+      if (!options.level)
+        return;
+
+      stats.before += instructions.size();
+
+      // relocations_in держит имена, на которые ссылаются items
+      relocations_t relocations_in = std::move(relocations);
+      relocations.clear();
+      items_t items = make_items(instructions, functions, relocations_in);
+      inline_leaves(items, options, stats);
+
+      std::vector<size_t> regions = { 0 };
+      for (size_t i = 0; i < items.size(); ++i) {
+        if (items[i].kind == item_t::function)
+          regions.push_back(i);
+      }
+      regions.push_back(items.size());
+
+      for (size_t r = 0; r + 1 < regions.size(); ++r) {
+        for (size_t round = 0; round < 4; ++round) {
+          bool changed = forward(items, regions[r], regions[r + 1], constants, stats);
+          changed |= backward(items, regions[r], regions[r + 1], stats);
+          if (!changed)
+            break;
+        }
+      }
+
+      layout(items, functions);
+
+      instructions.clear();
+      for (const auto& item : items) {
+        if (item.removed || item.kind == item_t::function)
+          continue;
+        if (item.kind == item_t::instruction) {
+          instructions.push_back(encode(item.decoded));
+          continue;
+        }
+        relocation_t relocation = { instructions.size(), item.size, item.rd, std::string(item.name) };
+        auto address = functions.find(item.name)->second;
+        if (item.decoded.handler == handler_const) {
+          instructions.push_back(encode(item.decoded));
+          constants[item.decoded.val] = address;
+        } else {
+          macro_set(instructions, item.rd, address);
+        }
+        if (instructions.size() - relocation.index != item.size)
+          throw fatal_error("address size mismatch");
+        relocations.push_back(std::move(relocation));
+      }
+
+      stats.after += instructions.size();
+
+      for (size_t i = 0; i < instructions.size(); ++i) {
+        DEBUG_LOGGER_VERBOSE_OPT("instruction: %08x '%s'", i * sizeof(instruction_t), print_instruction(instructions[i]).c_str());
+      }
+    }
+  }
+
+
+
+  namespace code_generator_n {
+    using namespace intermediate_code_generator_n;
+
+    // Готовая программа. text и data указывают либо на data_t из storage,
+    // либо на отображенный в память объектный файл (см. object_file_n).
+    struct program_t {
+      text_t                      text;
+      text_t                      data;
+      functions_t                 functions;
+      std::shared_ptr<const void> storage;
+    };
+
+    void process(data_t& text, const instructions_t& instructions) {
+      text.assign(sizeof(instruction_t) * instructions.size(), 0);
+      for (size_t i = 0; i < instructions.size(); ++i) {
+        memcpy(text.data() + i * sizeof(instruction_t), &instructions[i].value, sizeof(instruction_t));
+      }
+
+      for (size_t i = 0; i < text.size(); i += sizeof(instruction_t)) {
+        DEBUG_LOGGER_VERBOSE_CG("text: '%02hhx%02hhx'", text.at(i), text.at(i + 1));
+      }
+    }
+
+    // Листинг для сравнения выхода -O0 и -O1: адрес, код и мнемоника каждой инструкции.
+    std::string print_listing(const program_t& program) {
+      std::multimap<size_t, std::string_view> names;
+      for (const auto& [name, offset] : program.functions)
+        names.emplace(offset, name);
+
+      std::stringstream ss;
+      auto print_names = [&](size_t offset) {
+        auto [begin, end] = names.equal_range(offset);
+        for (auto it = begin; it != end; ++it)
+          ss << it->second << ":" << std::endl;
+      };
+
+      for (size_t offset = 0; offset < program.text.size(); offset += sizeof(instruction_t)) {
+        print_names(offset);
+
+        instruction_t instruction;
+        memcpy(&instruction.value, program.text.data() + offset, sizeof(instruction_t));
+        ss << "  " << std::hex << std::setfill('0') << std::setw(8) << offset << std::dec
+          << "   " << print_instruction(instruction) << std::endl;
+      }
+      print_names(program.text.size());
+
+      for (size_t offset = 0; offset + sizeof(reg_value_t) <= program.data.size(); offset += sizeof(reg_value_t)) {
+        reg_value_t value;
+        memcpy(&value, program.data.data() + offset, sizeof(value));
+        ss << "  const " << std::setfill(' ') << std::setw(3) << offset / sizeof(reg_value_t) << "   0x" << std::hex
+          << std::setfill('0') << std::setw(16) << value << std::dec << std::endl;
+      }
+
+      return ss.str();
+    }
+
+    // data - пул констант, 8 байт на значение, в одном буфере с текстом.
+    void process(program_t& program, const instructions_t& instructions, const functions_t& functions,
+        const constants_t& constants) {
+      auto storage = std::make_shared<data_t>();
+      process(*storage, instructions);
+      size_t text_size = storage->size();
+      storage->resize(text_size + constants.size() * sizeof(reg_value_t));
+      if (!constants.empty())
+        memcpy(storage->data() + text_size, constants.data(), constants.size() * sizeof(reg_value_t));
+
+      text_t all = *storage;
+      program.text      = all.first(text_size);
+      program.data      = all.subspan(text_size);
+      program.functions = functions;
+      program.storage   = storage;
+    }
+  }
+
+
+
+  // Объектный файл (little-endian):
+  //   header_t
+  //   segment_t[segments_count]
+  //   данные сегментов, каждый выровнен по 8 байт
+  // Сегмент символов: uint64_t count, symbol_t[count], затем имена подряд.
+  namespace object_file_n {
+
+    using namespace code_generator_n;
+
+    static constexpr std::array<char, 4> magic   = { 'R', 'I', 'S', 'C' };
+    static constexpr uint16_t            version = 2;
+
+    enum segment_type_t : uint32_t {
+      segment_text    = 1,
+      segment_data    = 2,
+      segment_symbols = 3,
+    };
+
+    struct header_t {
+      char     magic[4];
+      uint16_t version;
+      uint16_t segments_count;
+      uint64_t reserved;
+    };
+
+    struct segment_t {
+      uint32_t type;
+      uint32_t reserved;
+      uint64_t offset;
+      uint64_t size;
+    };
+
+    struct symbol_t {
+      uint64_t value;
+      uint32_t name_offset;
+      uint32_t name_size;
+    };
+
+    static_assert(sizeof(header_t) == 16 && sizeof(segment_t) == 24 && sizeof(symbol_t) == 16);
+    static_assert(std::endian::native == std::endian::little, "object files are little-endian");
+
+    constexpr uint64_t align(uint64_t value) {
+      return (value + 7) & ~uint64_t(7);
+    }
+
+    data_t make_symbols(const functions_t& functions) {
+      uint64_t count = functions.size();
+      size_t names_size = 0;
+      for (const auto& [name, offset] : functions)
+        names_size += name.size();
+
+      data_t symbols(sizeof(count) + count * sizeof(symbol_t) + names_size);
+      memcpy(symbols.data(), &count, sizeof(count));
+
+      size_t entry = sizeof(count);
+      size_t names = sizeof(count) + count * sizeof(symbol_t);
+      uint32_t name_offset = 0;
+      for (const auto& [name, offset] : functions) {
+        symbol_t symbol = { offset, name_offset, static_cast<uint32_t>(name.size()) };
+        memcpy(symbols.data() + entry, &symbol, sizeof(symbol));
+        memcpy(symbols.data() + names + name_offset, name.data(), name.size());
+        entry += sizeof(symbol);
+        name_offset += name.size();
+      }
+
+      return symbols;
+    }
+
+    void parse_symbols(functions_t& functions, text_t symbols) {
+      uint64_t count = 0;
+      if (symbols.size() < sizeof(count))
+        throw fatal_error("invalid symbols segment");
+      memcpy(&count, symbols.data(), sizeof(count));
+
+      if (count > (symbols.size() - sizeof(count)) / sizeof(symbol_t))
+        throw fatal_error("invalid symbols segment");
+
+      auto names = symbols.subspan(sizeof(count) + count * sizeof(symbol_t));
+      for (uint64_t i = 0; i < count; ++i) {
+        symbol_t symbol;
+        memcpy(&symbol, symbols.data() + sizeof(count) + i * sizeof(symbol_t), sizeof(symbol));
+        if (symbol.name_offset > names.size() || symbol.name_size > names.size() - symbol.name_offset)
+          throw fatal_error("invalid symbol name");
+        std::string_view name(reinterpret_cast<const char*>(names.data()) + symbol.name_offset, symbol.name_size);
+        functions.emplace(name, symbol.value);
+      }
+    }
+
+    void save(const std::string& path, const program_t& program) {
+      DEBUG_LOGGER_TRACE_CG;
+
+      data_t symbols = make_symbols(program.functions);
+
+      std::array<std::pair<segment_type_t, text_t>, 3> payloads = {{
+        { segment_text,    program.text },
+        { segment_data,    program.data },
+        { segment_symbols, symbols      },
+      }};
+
+      header_t header = {};
+      memcpy(header.magic, magic.data(), magic.size());
+      header.version        = version;
+      header.segments_count = payloads.size();
+
+      std::vector<segment_t> segments;
+      uint64_t offset = align(sizeof(header) + payloads.size() * sizeof(segment_t));
+      for (const auto& [type, payload] : payloads) {
+        segments.push_back({ type, 0, offset, payload.size() });
+        offset = align(offset + payload.size());
+      }
+
+      data_t file(offset, 0);
+      memcpy(file.data(), &header, sizeof(header));
+      memcpy(file.data() + sizeof(header), segments.data(), segments.size() * sizeof(segment_t));
+      for (size_t i = 0; i < segments.size(); ++i) {
+        if (!payloads[i].second.empty())
+          memcpy(file.data() + segments[i].offset, payloads[i].second.data(), payloads[i].second.size());
+      }
+
+      std::ofstream out(path, std::ios::binary | std::ios::trunc);
+      out.write(reinterpret_cast<const char*>(file.data()), file.size());
+      if (!out)
+        throw fatal_error("can not write '" + path + "'");
+
+      DEBUG_LOGGER_CG("saved: '%s' %zu bytes", path.c_str(), file.size());
+    }
+
+    bool is_object_file(const std::string& path) {
+      std::ifstream in(path, std::ios::binary);
+      std::array<char, 4> file_magic = {};
+      in.read(file_magic.data(), file_magic.size());
+      return in && file_magic == magic;
+    }
+
+    // Файл отображается в память только для чтения; text и data программы
+    // указывают прямо в отображение, которое живет, пока жив program.storage.
+    void load(program_t& program, const std::string& path) {
+      DEBUG_LOGGER_TRACE_CG;
+
+      int fd = ::open(path.c_str(), O_RDONLY);
+      if (fd < 0)
+        throw fatal_error("can not open '" + path + "'");
+
+      struct stat st;
+      if (::fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < sizeof(header_t)) {
+        ::close(fd);
+        throw fatal_error("invalid object file '" + path + "'");
+      }
+
+      size_t size = st.st_size;
+      void* address = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      ::close(fd);
+      if (address == MAP_FAILED)
+        throw fatal_error("can not map '" + path + "'");
+
+      std::shared_ptr<const void> storage(address, [size](const void* address) {
+        ::munmap(const_cast<void*>(address), size);
+      });
+      text_t file(static_cast<const uint8_t*>(address), size);
+
+      header_t header;
+      memcpy(&header, file.data(), sizeof(header));
+      if (!std::equal(magic.begin(), magic.end(), header.magic) || header.version != version)
+        throw fatal_error("invalid object file header '" + path + "'");
+      if (header.segments_count > (size - sizeof(header)) / sizeof(segment_t))
+        throw fatal_error("invalid object file segments '" + path + "'");
+
+      program = {};
+      for (size_t i = 0; i < header.segments_count; ++i) {
+        segment_t segment;
+        memcpy(&segment, file.data() + sizeof(header) + i * sizeof(segment_t), sizeof(segment));
+        if (segment.offset > size || segment.size > size - segment.offset)
+          throw fatal_error("invalid object file segment '" + path + "'");
+
+        auto payload = file.subspan(segment.offset, segment.size);
+        switch (segment.type) {
+          case segment_text:    program.text = payload;                      break;
+          case segment_data:    program.data = payload;                      break;
+          case segment_symbols: parse_symbols(program.functions, payload);  break;
+          default:                                                           break;
+        }
+      }
+
+      if (program.text.size() % sizeof(instruction_t))
+        throw fatal_error("invalid text segment '" + path + "'");
+      if (program.data.size() % sizeof(reg_value_t))
+        throw fatal_error("invalid data segment '" + path + "'");
+
+      program.storage = storage;
+
+      DEBUG_LOGGER_CG("loaded: '%s' text: %zu bytes, functions: %zu", path.c_str(), program.text.size(), program.functions.size());
+    }
+  }
+
+
+
+  // Кэш собранных программ. Ключ - хеш исходника вместе с уровнем оптимизации
+  // и версией объектного файла, для надежности сверяется еще и длина исходника.
+  // В памяти - LRU на capacity программ, в каталоге dir (если задан) - объектные
+  // файлы, которые загружаются через mmap без повторной сборки.
+  namespace compile_cache_n {
+
+    using namespace code_generator_n;
+
+    struct stats_t {
+      size_t hits      = 0;   // найдено в памяти
+      size_t disk_hits = 0;   // загружено из каталога
+      size_t misses    = 0;   // собрано заново
+      size_t evictions = 0;   // вытеснено из памяти
+    };
+
+    std::string print_stats(const stats_t& stats) {
+      std::stringstream ss;
+      ss << "cache hits:      " << stats.hits      << std::endl
+         << "cache disk hits: " << stats.disk_hits << std::endl
+         << "cache misses:    " << stats.misses    << std::endl
+         << "cache evictions: " << stats.evictions << std::endl;
+      return ss.str();
+    }
+
+    // FNV-1a 64
+    uint64_t content_hash(std::string_view code, const code_optimizer_n::options_t& options) {
+      uint64_t hash = 14695981039346656037ull;
+      auto mix = [&hash](uint8_t byte) {
+        hash ^= byte;
+        hash *= 1099511628211ull;
+      };
+      for (char c : code)
+        mix(static_cast<uint8_t>(c));
+      mix(options.level);
+      for (size_t i = 0; i < sizeof(options.inline_limit); ++i)
+        mix(options.inline_limit >> (8 * i) & 0xFF);
+      mix(object_file_n::version & 0xFF);
+      mix(object_file_n::version >> 8);
+      return hash;
+    }
+
+    class cache_t {
+     public:
+      explicit cache_t(size_t capacity = 64, std::string dir = {}) : capacity(std::max<size_t>(capacity, 1)), dir(std::move(dir)) {
+        if (!this->dir.empty() && ::mkdir(this->dir.c_str(), 0755) < 0 && errno != EEXIST)
+          throw fatal_error("can not create cache directory '" + this->dir + "'");
+      }
+
+      bool find(program_t& program, uint64_t key, size_t size) {
+        if (auto it = index.find(key); it != index.end() && it->second->size == size) {
+          entries.splice(entries.begin(), entries, it->second);
+          program = it->second->program;
+          ++counters.hits;
+          DEBUG_LOGGER_CG("cache hit: %016lx", key);
+          return true;
+        }
+
+        // Поврежденный файл удаляется и считается промахом: программа пересобирается.
+        if (!dir.empty() && object_file_n::is_object_file(path(key, size))) {
+          auto file = path(key, size);
+          try {
+            object_file_n::load(program, file);
+            remember(key, size, program);
+            ++counters.disk_hits;
+            DEBUG_LOGGER_CG("cache disk hit: %016lx", key);
+            return true;
+          } catch (const fatal_error& e) {
+            std::remove(file.c_str());
+            program = {};
+            DEBUG_LOGGER_CG("cache disk entry dropped: %s", e.what());
+          }
+        }
+
+        ++counters.misses;
+        DEBUG_LOGGER_CG("cache miss: %016lx", key);
+        return false;
+      }
+
+      // Запись на диск не критична: при ошибке программа остается только в памяти.
+      void insert(uint64_t key, size_t size, const program_t& program) {
+        remember(key, size, program);
+        if (dir.empty())
+          return;
+
+        auto target = path(key, size);
+        auto temporary = target + "." + std::to_string(::getpid()) + ".tmp";
+        try {
+          object_file_n::save(temporary, program);
+          if (std::rename(temporary.c_str(), target.c_str()))
+            throw fatal_error("can not rename '" + temporary + "'");
+        } catch (const fatal_error& e) {
+          std::remove(temporary.c_str());
+          DEBUG_LOGGER_CG("cache store failed: %s", e.what());
+        }
+      }
+
+      const stats_t& stats() const {
+        return counters;
+      }
+
+      size_t size() const {
+        return entries.size();
+      }
+
+     private:
+      struct entry_t {
+        uint64_t  key;
+        size_t    size;
+        program_t program;
+      };
+
+      void remember(uint64_t key, size_t size, const program_t& program) {
+        if (auto it = index.find(key); it != index.end()) {
+          entries.erase(it->second);
+          index.erase(it);
+        }
+
+        entries.push_front({ key, size, program });
+        index[key] = entries.begin();
+
+        if (entries.size() > capacity) {
+          index.erase(entries.back().key);
+          entries.pop_back();
+          ++counters.evictions;
+        }
+      }
+
+      std::string path(uint64_t key, size_t size) const {
+        char name[64];
+        snprintf(name, sizeof(name), "/%016lx-%zu.rx", key, size);
+        return dir + name;
+      }
+
+      size_t                                                   capacity;
+      std::string                                              dir;
+      std::list<entry_t>                                       entries;   // от недавних к давним
+      std::unordered_map<uint64_t, std::list<entry_t>::iterator> index;
+      stats_t                                                  counters;
+    };
+  }
+
+
+
+  // Проверка программы при загрузке: декодированный текст (после fuse тоже) и таблица
+  // символов, из исходника или из объектного файла. Некорректная программа отвергается
+  // до исполнения, для корректной считаются известные цели переходов и глубина вызовов.
+  namespace semantic_analyzer_n {
+
+    using namespace decoder_n;
+
+    static constexpr uint8_t reg_ri = reg_index_c("RI");
+    static constexpr size_t  npos   = std::numeric_limits<size_t>::max();
+
+    struct verdict_t {
+      bool                  verified  = false;   // RI меняют только CALL, BR и RET - можно исполнять без проверки RI на каждой инструкции
+      std::string           reason;              // почему не verified
+      std::optional<size_t> max_depth;           // наибольшая вложенность CALL от __start, если граф вызовов известен
+      bool                  recursive = false;   // граф вызовов известен, но в нем есть цикл
+      size_t                calls     = 0;       // CALL с известной целью
+      size_t                branches  = 0;       // BR с известной целью
+      size_t                dynamic   = 0;       // CALL и BR с целью, известной только при исполнении
+    };
+
+    std::string print_verdict(const verdict_t& verdict) {
+      std::stringstream ss;
+      ss << "verified:  " << (verdict.verified ? "yes" : "no (" + verdict.reason + ")") << std::endl
+        << "max depth: ";
+      if (verdict.max_depth)
+        ss << *verdict.max_depth;
+      else
+        ss << (verdict.recursive ? "unknown (recursion)" : "unknown (dynamic targets)");
+      ss << std::endl
+        << "calls:     " << verdict.calls    << std::endl
+        << "branches:  " << verdict.branches << std::endl
+        << "dynamic:   " << verdict.dynamic  << std::endl;
+      return ss.str();
+    }
+
+    // Значения регистров распространяются по тексту, цели BR с известным адресом
+    // получают объединение состояний, неизвестная цель BR делает неизвестными все метки.
+    // Как и оптимизатор, верификатор считает регистры функции локальными: CALL, SAVE и
+    // YIELD их не меняют. От этого зависят только известные цели и глубина, а не
+    // безопасность без проверок: цель любого перехода проверяется при исполнении.
+    // Недостижимый код в целях не участвует. Слитые инструкции разбираются как
+    // исходные: вход в середину слитой последовательности исполняет исходные инструкции.
+    verdict_t verify(const decoded_text_t& decoded, const functions_t& functions) {
+      using state_t = std::array<std::optional<reg_value_t>, 16>;
+
+      auto where = [](reg_value_t address) {
+        std::stringstream ss;
+        ss << "0x" << std::hex << address;
+        return ss.str();
+      };
+
+      if (decoded.empty())
+        throw fatal_error("verifier: empty text");
+
+      // входы функций (по возрастанию) и метки
+      std::vector<size_t> entries;
+      std::vector<bool> labels(decoded.size());
+      size_t start = npos;
+      for (const auto& [name, address] : functions) {
+        if (address % sizeof(instruction_t) || address / sizeof(instruction_t) >= decoded.size())
+          throw fatal_error("verifier: symbol '" + name + "' is not an instruction boundary");
+        if (is_label(name)) {
+          labels[address / sizeof(instruction_t)] = true;
+          continue;
+        }
+        entries.push_back(address / sizeof(instruction_t));
+        if (name == "__start")
+          start = entries.back();
+      }
+      std::sort(entries.begin(), entries.end());
+      entries.erase(std::unique(entries.begin(), entries.end()), entries.end());
+
+      // функция каждой инструкции, npos - код до первой функции
+      std::vector<size_t> owners(decoded.size(), npos);
+      for (size_t f = 0; f < entries.size(); ++f)
+        std::fill(owners.begin() + entries[f], f + 1 < entries.size() ? owners.begin() + entries[f + 1] : owners.end(), f);
+
+      verdict_t verdict;
+      verdict.verified = true;
+      for (size_t i = 0; i < decoded.size(); ++i) {
+        if (decoded[i].handler == handler_invalid)
+          throw fatal_error("verifier: unknown instruction at " + where(i * sizeof(instruction_t)));
+        auto operands = handlers_operands[decoded[i].handler];
+        if (verdict.verified && operands & operand_rd && writes_rd(decoded[i].handler) && decoded[i].rd == reg_ri) {
+          verdict.verified = false;
+          verdict.reason   = "RI written at " + where(i * sizeof(instruction_t));
+        }
+      }
+      if (decoded.back().handler != handler_ret)
+        throw fatal_error("verifier: text does not end with RET");
+
+      std::unordered_map<size_t, state_t> heads;   // состояние на входе в цель BR
+      std::vector<std::set<size_t>> callees(entries.size());
+      bool dynamic_branch = false;
+      bool cross_branch   = false;   // BR в другую функцию: ее вызовы идут с чужой глубины
+
+      for (bool changed = true; changed; ) {
+        changed = false;
+        verdict.calls = verdict.branches = verdict.dynamic = 0;
+        for (auto& set : callees)
+          set.clear();
+        bool dynamic = false;
+
+        state_t state;
+        bool falls = false;   // в i можно попасть из i - 1
+        for (size_t i = 0; i < decoded.size(); ++i) {
+          auto head = heads.find(i);
+          if (std::binary_search(entries.begin(), entries.end(), i) || (labels[i] && dynamic_branch)) {
+            state.fill(std::nullopt);
+          } else if (head == heads.end() && !falls) {
+            continue;   // недостижима
+          } else if (head != heads.end()) {
+            for (size_t r = 0; r < state.size(); ++r) {
+              if (!falls)
+                state[r] = head->second[r];
+              else if (state[r] != head->second[r])
+                state[r].reset();
+            }
+          }
+
+          // слитая инструкция проверяется как первая из последовательности
+          auto instruction = decoded[i].handler > handler_invalid ? decode(decoded[i].raw) : decoded[i];
+          falls = true;
+
+          switch (instruction.handler) {
+            case handler_set:
+              state[instruction.rd] = instruction.val;
+              break;
+            case handler_const:
+              state[instruction.rd] = instruction.imm;
+              break;
+            case handler_mov:
+              state[instruction.rd] = state[instruction.rs1];
+              break;
+            case handler_not:
+              state[instruction.rd] = state[instruction.rs1] ? std::optional<reg_value_t>(~*state[instruction.rs1]) : std::nullopt;
+              break;
+            case handler_and:
+            case handler_or:
+            case handler_xor:
+            case handler_add:
+            case handler_sub:
+            case handler_mult:
+            case handler_div:
+            case handler_lsh:
+            case handler_rsh:
+              state[instruction.rd] = code_optimizer_n::fold(instruction.handler, state[instruction.rs1], state[instruction.rs2]);
+              break;
+
+            case handler_call: {
+              auto target = state[instruction.rs1];
+              if (!target) {
+                ++verdict.dynamic;
+                break;
+              }
+              auto index = static_cast<reg_uvalue_t>(*target) / sizeof(instruction_t);
+              if (*target % sizeof(instruction_t) || index >= decoded.size()
+                  || !std::binary_search(entries.begin(), entries.end(), index))
+                throw fatal_error("verifier: CALL at " + where(i * sizeof(instruction_t)) + " to " + where(*target) + " which is not a function");
+              ++verdict.calls;
+              if (owners[i] != npos)
+                callees[owners[i]].insert(owners[index]);
+              break;
+            }
+
+            case handler_br: {
+              auto target = state[instruction.rd];
+              auto taken  = state[instruction.rs1];
+              falls = !taken || !*taken;
+              if (taken && !*taken)
+                break;
+              if (!target) {
+                ++verdict.dynamic;
+                dynamic = true;
+                break;
+              }
+              auto index = static_cast<reg_uvalue_t>(*target) / sizeof(instruction_t);
+              if (*target % sizeof(instruction_t) || index >= decoded.size())
+                throw fatal_error("verifier: BR at " + where(i * sizeof(instruction_t)) + " to " + where(*target) + " outside text");
+              ++verdict.branches;
+              cross_branch |= owners[index] != owners[i];
+              auto [it, inserted] = heads.try_emplace(index, state);
+              for (size_t r = 0; !inserted && r < state.size(); ++r) {
+                if (it->second[r] && it->second[r] != state[r]) {
+                  it->second[r].reset();
+                  changed = true;
+                }
+              }
+              changed |= inserted;
+              break;
+            }
+
+            case handler_ret:
+              falls = false;
+              break;
+
+            default:
+              // LOAD*, HCALL, HBATCH - неизвестное значение, SAVE* и YIELD регистров не меняют
+              if (writes_rd(instruction.handler))
+                state[instruction.rd].reset();
+              break;
+          }
+        }
+
+        if (dynamic != dynamic_branch) {
+          dynamic_branch = dynamic;
+          changed = true;
+        }
+      }
+
+      // глубина - самый длинный путь по CALL от __start
+      if (start == npos || verdict.dynamic || cross_branch)
+        return verdict;
+
+      auto root = owners[start];
+      std::vector<uint8_t> color(entries.size(), 0);   // 0 - не обойдена, 1 - на пути, 2 - готова
+      std::vector<size_t> depth(entries.size(), 0);
+      std::vector<std::pair<size_t, std::set<size_t>::const_iterator>> path = { { root, callees[root].begin() } };
+      color[root] = 1;
+      while (!path.empty()) {
+        auto& [f, it] = path.back();
+        if (it == callees[f].end()) {
+          color[f] = 2;
+          auto done = f;
+          path.pop_back();
+          if (!path.empty())
+            depth[path.back().first] = std::max(depth[path.back().first], depth[done] + 1);
+          continue;
+        }
+        auto callee = *it++;
+        if (color[callee] == 1) {
+          verdict.recursive = true;
+          return verdict;
+        }
+        if (color[callee] == 2) {
+          depth[f] = std::max(depth[f], depth[callee] + 1);
+          continue;
+        }
+        color[callee] = 1;
+        path.emplace_back(callee, callees[callee].begin());
+      }
+      verdict.max_depth = depth[root];
+
+      return verdict;
+    }
+  }
+
+
+
+  namespace executor_n {
+
+    using namespace decoder_n;
+
+    using registers_set_t = reg_value_t[16];
+
+    static constexpr uint8_t reg_ri = reg_index_c("RI");
+    static constexpr uint8_t reg_rp = reg_index_c("RP");
+    static constexpr uint8_t reg_rb = reg_index_c("RB");
+    static constexpr uint8_t reg_rs = reg_index_c("RS");
+    static constexpr uint8_t reg_rt = reg_index_c("RT");
+    static constexpr uint8_t reg_r1 = reg_index_c("R1");
+
+    enum class engine_t {
+      table,      // цикл с диспетчеризацией через handlers_fn
+      threaded,   // direct threading (labels-as-values), регистры в локальных переменных
+      jit,        // машинный код x86-64, на других платформах - threaded
+      block,      // базовые блоки: RI и бюджет проверяются на границе блока, а не на каждой инструкции
+    };
+
+    // Такты процессора для профилировщика, вне x86-64 - наносекунды steady_clock.
+    inline uint64_t profiler_clock() {
+#if defined(__x86_64__)
+      return __rdtsc();
+#else
+      return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+    }
+
+    // Профиль гостевых функций: исполненные инструкции и такты по функциям
+    // (собственные и включая вызванные) и дерево вызовов для collapsed stacks.
+    // Обновляется только в CALL и RET, поэтому работает со всеми исполнителями.
+    struct profiler_t {
+      struct function_t {
+        std::string name;
+        uint64_t    calls                  = 0;
+        uint64_t    instructions           = 0;
+        uint64_t    cycles                 = 0;
+        uint64_t    inclusive_instructions = 0;
+        uint64_t    inclusive_cycles       = 0;
+        uint32_t    active                 = 0;   // вхождений в стеке, для рекурсии
+      };
+
+      struct node_t {
+        uint32_t                     function;
+        uint32_t                     parent;
+        std::map<uint32_t, uint32_t> children;    // функция -> узел
+        uint64_t                     instructions = 0;
+        uint64_t                     cycles       = 0;
+      };
+
+      struct frame_t {
+        uint32_t node;
+        uint64_t instructions;
+        uint64_t cycles;
+        uint64_t child_instructions = 0;
+        uint64_t child_cycles       = 0;
+      };
+
+      std::vector<function_t>        functions;
+      std::map<reg_value_t, uint32_t> addresses;   // вход функции -> функция
+      std::vector<node_t>            nodes = { { 0, 0, {} } };   // 0 - корень без функции
+      std::vector<frame_t>           stack;
+
+      void init(const functions_t& symbols) {
+        *this = {};
+        for (const auto& [name, address] : symbols) {
+          if (is_label(name))
+            continue;
+          addresses[address] = functions.size();
+          functions.push_back({ name });
+        }
+      }
+
+      // Адрес вне известных функций получает имя ближайшей функции со смещением.
+      uint32_t function(reg_value_t address) {
+        auto it = addresses.upper_bound(address);
+        if (it != addresses.begin() && std::prev(it)->first == address)
+          return std::prev(it)->second;
+
+        std::stringstream ss;
+        if (it != addresses.begin())
+          ss << functions[std::prev(it)->second].name << "+0x" << std::hex << address - std::prev(it)->first;
+        else
+          ss << "0x" << std::hex << address;
+        addresses[address] = functions.size();
+        functions.push_back({ ss.str() });
+        return functions.size() - 1;
+      }
+
+      void enter(reg_value_t address, uint64_t steps) {
+        auto id = function(address);
+        auto parent = stack.empty() ? 0 : stack.back().node;
+        auto [it, inserted] = nodes[parent].children.try_emplace(id, nodes.size());
+        if (inserted)
+          nodes.push_back({ id, parent, {} });
+
+        ++functions[id].calls;
+        ++functions[id].active;
+        stack.push_back({ it->second, steps, profiler_clock() });
+      }
+
+      void leave(uint64_t steps) {
+        if (stack.empty())
+          return;
+
+        auto frame = stack.back();
+        stack.pop_back();
+
+        uint64_t instructions = steps - frame.instructions;
+        uint64_t cycles = profiler_clock() - frame.cycles;
+
+        auto& node = nodes[frame.node];
+        node.instructions += instructions - frame.child_instructions;
+        node.cycles       += cycles - frame.child_cycles;
+
+        auto& function = functions[node.function];
+        function.instructions += instructions - frame.child_instructions;
+        function.cycles       += cycles - frame.child_cycles;
+        if (!--function.active) {
+          function.inclusive_instructions += instructions;
+          function.inclusive_cycles       += cycles;
+        }
+
+        if (!stack.empty()) {
+          stack.back().child_instructions += instructions;
+          stack.back().child_cycles       += cycles;
+        }
+      }
+
+      // Фреймы, не дошедшие до RET (ошибка исполнения), закрываются текущим моментом.
+      void finish(uint64_t steps) {
+        while (!stack.empty())
+          leave(steps);
+      }
+    };
+
+    // Частоты n-грамм (n = 2..4) исполненных инструкций внутри линейных участков:
+    // окно сбрасывается на CALL и RET. Ключ - номера обработчиков + 1 по байту на каждый.
+    struct profile_t {
+      std::map<uint32_t, uint64_t> ngrams;
+      uint32_t                     window = 0;
+
+      void record(uint8_t handler) {
+        uint32_t code = handler + 1u;
+        for (uint32_t n = 1; n < 4; ++n) {
+          uint32_t prefix = window & ((1u << 8 * n) - 1);
+          if (!(prefix >> 8 * (n - 1)))
+            break;
+          ++ngrams[prefix << 8 | code];
+        }
+        window = (window << 8 | code) & 0xFFFFFF;
+      }
+
+      void reset() {
+        window = 0;
+      }
+    };
+
+    // Бинарная трассировка: запись на каждую исполненную инструкцию,
+    // у CALL и RET измененный регистр - RB нового фрейма.
+    struct trace_record_t {
+      uint32_t    pc;
+      uint16_t    raw;
+      uint8_t     reg;      // trace_no_reg - регистры не менялись
+      uint8_t     length;   // у слитых инструкций больше 1
+      reg_value_t value;
+    };
+
+    static_assert(sizeof(trace_record_t) == 16);
+
+    static constexpr uint8_t trace_no_reg = 0xFF;
+    static constexpr std::array<char, 4> trace_magic = { 'R', 'T', 'R', 'C' };
+
+    // Исполнитель пишет записи в кольцо, поток записи сбрасывает их в файл пачками.
+    // При переполнении кольца исполнитель ждет поток записи, записи не теряются.
+    class trace_writer_t {
+     public:
+      explicit trace_writer_t(const std::string& path, size_t capacity = 1 << 16)
+          : ring(capacity), out(path, std::ios::binary | std::ios::trunc) {
+        if (!out)
+          throw fatal_error("can not open '" + path + "'");
+        out.write(trace_magic.data(), trace_magic.size());
+        thread = std::thread([this] { drain(); });
+      }
+
+      ~trace_writer_t() {
+        done.store(true, std::memory_order_release);
+        thread.join();
+      }
+
+      void push(const trace_record_t& record) {
+        while (!ring.push(record))
+          std::this_thread::yield();
+      }
+
+     private:
+      void drain() {
+        std::vector<trace_record_t> buffer(4096);
+        while (true) {
+          bool finished = done.load(std::memory_order_acquire);
+          size_t count = ring.pop(buffer.data(), buffer.size());
+          if (count)
+            out.write(reinterpret_cast<const char*>(buffer.data()), count * sizeof(trace_record_t));
+          else if (finished)
+            break;
+          else
+            std::this_thread::yield();
+        }
+      }
+
+      spsc_ring_t<trace_record_t> ring;
+      std::ofstream               out;
+      std::atomic<bool>           done = false;
+      std::thread                 thread;
+    };
+
+    // Текстовый вид записи в формате листинга и print_stack.
+    std::string print_trace_record(const trace_record_t& record) {
+      instruction_t instruction;
+      instruction.value = record.raw;
+
+      std::stringstream ss;
+      ss << std::hex << std::setfill('0') << std::setw(8) << record.pc << "   "
+        << std::setfill(' ') << std::setw(24) << std::left << print_instruction(instruction) << std::right;
+      if (record.length > 1)
+        ss << " +" << std::dec << record.length - 1;
+      if (record.reg != trace_no_reg) {
+        ss << "   " << reg_name(record.reg) << "   " << std::hex << std::setfill('0')
+          << std::setw(2 * sizeof(reg_value_t)) << record.value;
+      }
+      return ss.str();
+    }
+
+    // Офлайн-декодер файла трассировки.
+    void print_trace(std::ostream& os, const std::string& path) {
+      std::ifstream in(path, std::ios::binary);
+      std::array<char, 4> file_magic = {};
+      in.read(file_magic.data(), file_magic.size());
+      if (!in || file_magic != trace_magic)
+        throw fatal_error("'" + path + "' is not a trace file");
+
+      trace_record_t record;
+      while (in.read(reinterpret_cast<char*>(&record), sizeof(record)))
+        os << print_trace_record(record) << std::endl;
+    }
+
+    class host_t;
+
+    struct options_t {
+      engine_t        engine   = engine_t::table;
+      bool            trace    = true;      // текстовая трассировка, DEBUG_LOGGER_LEVEL >= 3
+      bool            fuse     = true;
+      profile_t*      profile  = nullptr;   // только для engine_t::table
+      trace_writer_t* writer   = nullptr;   // только для engine_t::table
+      profiler_t*     profiler = nullptr;
+      size_t          stack_size = 16 << 20;   // байт виртуальной памяти под стек
+      size_t          max_depth  = 1 << 16;    // вложенность CALL
+      uint64_t        memory_size = 1ull << 32;  // граница адресного пространства гостя
+      uint64_t        budget      = 0;         // шагов до ловушки, 0 - без ограничения
+      bool            unchecked   = false;     // table без проверки RI на каждой инструкции, если верификатор разрешил
+      const host_t*   host        = nullptr;   // обработчики HCALL и HBATCH
+    };
+
+    static constexpr uint64_t steps_unlimited = std::numeric_limits<uint64_t>::max();
+
+    // Ошибка гостевой программы (переполнение стека, плохой фрейм), а не интерпретатора.
+    struct trap_error : fatal_error {
+      using fatal_error::fatal_error;
+    };
+
+    // Стек гостя: резервируется виртуальная память без доступа, страницы открываются
+    // на запись по мере роста (ядро отдает их нулевыми при первом касании),
+    // за резервом - защитная страница. Фреймы выделяются подряд от RS вызывающего,
+    // RET возвращает вершину к фрейму вызывающего. Освобожденные резервы остаются
+    // в пуле потока и переиспользуются, открытая часть при этом обнуляется.
+    class stack_t {
+     public:
+      stack_t() = default;
+      stack_t(const stack_t&) = delete;
+      stack_t& operator=(const stack_t&) = delete;
+
+      ~stack_t() {
+        release();
+      }
+
+      // Открытая часть стека, сохраненная в memfd.
+      struct frozen_t {
+        std::shared_ptr<const int> file;
+        size_t                     size     = 0;
+        size_t                     capacity = 0;
+      };
+
+      void reserve(size_t size) {
+        if (!acquire(size))
+          return;
+        if (mapping.committed <= zero_limit)
+          memset(mapping.base, 0, mapping.committed);
+        else
+          madvise(mapping.base, mapping.committed, MADV_DONTNEED);
+      }
+
+      // Копия открытой части, из которой fork открывает стеки других VM.
+      frozen_t freeze() const {
+        frozen_t frozen { nullptr, mapping.committed, mapping.capacity };
+        if (!frozen.size)
+          return frozen;
+
+        int fd = memfd_create("risc-stack", MFD_CLOEXEC);
+        if (fd < 0)
+          throw fatal_error("can not create stack snapshot");
+        frozen.file = std::shared_ptr<const int>(new int(fd), [](const int* p) { close(*p); delete p; });
+        if (ftruncate(fd, frozen.size))
+          throw fatal_error("can not create stack snapshot");
+        for (size_t done = 0; done < frozen.size; ) {
+          auto written = pwrite(fd, mapping.base + done, frozen.size - done, done);
+          if (written <= 0)
+            throw fatal_error("can not create stack snapshot");
+          done += written;
+        }
+        return frozen;
+      }
+
+      // Резерв той же емкости, открытая часть - частное отображение снимка:
+      // страницы общие, пока VM их не изменит, копирует их ядро.
+      void fork(const frozen_t& frozen) {
+        acquire(frozen.capacity);
+        if (mapping.committed > frozen.size)
+          discard(frozen.size, mapping.committed - frozen.size);
+        if (frozen.size && mmap(mapping.base, frozen.size, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_FIXED, *frozen.file, 0) == MAP_FAILED)
+          throw fatal_error("can not map stack snapshot");
+        mapping.committed = frozen.size;
+        mapping.file      = frozen.size != 0;
+      }
+
+      uint8_t* data() const {
+        return mapping.base;
+      }
+
+      size_t size() const {
+        return mapping.committed;
+      }
+
+      size_t capacity() const {
+        return mapping.capacity;
+      }
+
+      // [offset, offset + size) внутри резерва, страницы открываются при необходимости.
+      uint8_t* reach(size_t offset, size_t size) {
+        if (offset > mapping.capacity || size > mapping.capacity - offset)
+          throw trap_error("stack overflow");
+        commit(offset + size);
+        return mapping.base + offset;
+      }
+
+      // Фрейм по смещению offset, страницы под него открываются при необходимости.
+      registers_set_t* frame(reg_value_t offset) {
+        if (offset < 0 || offset % sizeof(reg_value_t)
+            || static_cast<uint64_t>(offset) + sizeof(registers_set_t) > mapping.capacity)
+          throw trap_error("stack overflow");
+        commit(offset + sizeof(registers_set_t));
+        return reinterpret_cast<registers_set_t*>(mapping.base + offset);
+      }
+
+      uint8_t at(size_t offset) const {
+        if (offset >= mapping.committed)
+          throw trap_error("stack access out of range");
+        return mapping.base[offset];
+      }
+
+     private:
+      struct mapping_t {
+        uint8_t* base      = nullptr;
+        size_t   capacity  = 0;
+        size_t   committed = 0;
+        size_t   page      = 0;
+        bool     file      = false;   // начало отображено из снимка
+      };
+
+      struct pool_t {
+        std::vector<mapping_t> mappings;
+
+        ~pool_t() {
+          for (const auto& mapping : mappings)
+            munmap(mapping.base, mapping.capacity + mapping.page);
+        }
+
+        static pool_t& instance() {
+          static thread_local pool_t pool;
+          return pool;
+        }
+      };
+
+      void commit(size_t end) {
+        if (end <= mapping.committed)
+          return;
+        size_t target = std::min(mapping.capacity, std::max(mapping.committed * 2, (end + chunk - 1) / chunk * chunk));
+        if (mprotect(mapping.base + mapping.committed, target - mapping.committed, PROT_READ | PROT_WRITE))
+          throw fatal_error("can not commit stack");
+        mapping.committed = target;
+      }
+
+      // Резерв из пула потока (true, открытая часть не очищена) или новый.
+      bool acquire(size_t size) {
+        release();
+        size_t page = sysconf(_SC_PAGESIZE);
+        size = (size + page - 1) / page * page;
+
+        auto& pool = pool_t::instance().mappings;
+        auto it = std::find_if(pool.begin(), pool.end(), [size](const auto& mapping) { return mapping.capacity == size; });
+        if (it != pool.end()) {
+          mapping = *it;
+          pool.erase(it);
+          return true;
+        }
+
+        void* addr = mmap(nullptr, size + page, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (addr == MAP_FAILED)
+          throw fatal_error("can not reserve stack");
+        mapping = { static_cast<uint8_t*>(addr), size, 0, page };
+        return false;
+      }
+
+      // Закрывает [offset, offset + size) заново, страницы отдаются системе.
+      void discard(size_t offset, size_t size) {
+        if (mmap(mapping.base + offset, size, PROT_NONE,
+              MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0) == MAP_FAILED)
+          throw fatal_error("can not reset stack");
+      }
+
+      void release() {
+        if (!mapping.base)
+          return;
+        auto& pool = pool_t::instance().mappings;
+        bool reusable = true;
+        if (mapping.file) {
+          // в пул - без ссылки на снимок
+          reusable = mmap(mapping.base, mapping.committed, PROT_NONE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0) != MAP_FAILED;
+          mapping.committed = 0;
+          mapping.file      = false;
+        }
+        if (reusable && pool.size() < pool_size)
+          pool.push_back(mapping);
+        else
+          munmap(mapping.base, mapping.capacity + mapping.page);
+        mapping = {};
+      }
+
+      static constexpr size_t chunk      = 16 << 10;
+      static constexpr size_t zero_limit = 256 << 10;
+      static constexpr size_t pool_size  = 4;
+
+      mapping_t mapping;
+    };
+
+    // Адресное пространство гостя: [0, емкость стека) - стек VM (RB и RS - адреса в нем),
+    // выше до memory_size - данные, страницы по 4 KiB выделяются при первой записи,
+    // чтение невыделенной страницы дает нули. Трансляция идет через TLB прямого
+    // отображения: совпадение тега - одно сравнение и одно сложение. Тег включает
+    // младшие биты адреса, поэтому невыровненный доступ уходит в медленный путь,
+    // а выровненный никогда не пересекает границу страницы.
+    // Под собственными страницами могут лежать базовые, общие со снимком: они
+    // попадают в TLB только на чтение, первая запись копирует страницу в собственные.
+    class memory_t {
+     public:
+      static constexpr size_t page_bits = 12;
+      static constexpr size_t page_size = 1 << page_bits;
+      static constexpr size_t tlb_bits  = 6;
+      static constexpr size_t tlb_size  = 1 << tlb_bits;
+
+      using page_t       = std::array<uint8_t, page_size>;
+      using shared_map_t = std::unordered_map<uint64_t, std::shared_ptr<const page_t>>;
+
+      struct tlb_entry_t {
+        uint64_t read;      // адрес страницы, если чтение разрешено
+        uint64_t write;     // адрес страницы, если запись разрешена
+        intptr_t addend;    // хост-адрес минус адрес гостя
+        uint64_t padding;
+      };
+
+      static_assert(sizeof(tlb_entry_t) == 32, "jit indexes tlb by shift");
+
+      static constexpr uint64_t tlb_invalid = ~0ull;
+
+      void init(stack_t* stack_, uint64_t limit_, std::shared_ptr<const shared_map_t> base_ = nullptr) {
+        stack = stack_;
+        limit = limit_;
+        base  = std::move(base_);
+        pages.clear();
+        flush();
+      }
+
+      // Все страницы становятся базовыми и общими с возвращенной таблицей,
+      // дальнейшие записи копируют их.
+      std::shared_ptr<const shared_map_t> freeze() {
+        if (!pages.empty()) {
+          auto frozen = std::make_shared<shared_map_t>(base ? *base : shared_map_t());
+          for (auto& [address, page] : pages)
+            (*frozen)[address] = std::shared_ptr<const page_t>(std::move(page));
+          pages.clear();
+          base = std::move(frozen);
+          flush();
+        }
+        return base;
+      }
+
+      uint64_t size_limit() const {
+        return limit;
+      }
+
+      void flush() {
+        for (auto& entry : tlb)
+          entry = { tlb_invalid, tlb_invalid, 0, 0 };
+      }
+
+      template<typename T>
+      static constexpr uint64_t tag_mask() {
+        return ~uint64_t(page_size - 1) | (sizeof(T) - 1);
+      }
+
+      static size_t tlb_index(uint64_t address) {
+        return address >> page_bits & (tlb_size - 1);
+      }
+
+      template<typename T>
+      T load(uint64_t address) {
+        const auto& entry = tlb[tlb_index(address)];
+        if ((address & tag_mask<T>()) != entry.read) [[unlikely]]
+          return load_slow<T>(address);
+        T value;
+        memcpy(&value, reinterpret_cast<const void*>(address + entry.addend), sizeof(T));
+        return value;
+      }
+
+      template<typename T>
+      void save(uint64_t address, T value) {
+        const auto& entry = tlb[tlb_index(address)];
+        if ((address & tag_mask<T>()) != entry.write) [[unlikely]]
+          return save_slow<T>(address, value);
+        memcpy(reinterpret_cast<void*>(address + entry.addend), &value, sizeof(T));
+      }
+
+      // Собственные страницы, без общих со снимком.
+      size_t pages_count() const {
+        return pages.size();
+      }
+
+      static size_t tlb_offset() {
+        return offsetof(memory_t, tlb);
+      }
+
+      // [address, address + size) памяти гостя без копирования: fn получает куски
+      // std::span<uint8_t> в хост-памяти. Стек отдается одним куском, остальная память -
+      // по страницам. Для write общие со снимком страницы копируются заранее,
+      // без write незаписанные страницы читаются нулями.
+      template<typename Fn>
+      void view(uint64_t address, size_t size, bool write, Fn&& fn) {
+        check(address, size);
+        while (size) {
+          size_t chunk;
+          uint8_t* host;
+          if (address < stack->capacity()) {
+            chunk = std::min<uint64_t>(size, stack->capacity() - address);
+            host  = stack->reach(address, chunk);
+          } else {
+            chunk = std::min<uint64_t>(size, page_size - (address & (page_size - 1)));
+            host  = translate(address, write) + (address & (page_size - 1));
+          }
+          fn(std::span<uint8_t>(host, chunk));
+          address += chunk;
+          size    -= chunk;
+        }
+      }
+
+      // Хост-адрес size байт, не пересекающих границу страницы.
+      uint8_t* reach(uint64_t address, size_t size, bool write) {
+        check(address, size);
+        if ((address & (page_size - 1)) + size > page_size)
+          throw trap_error("memory fault");
+        const auto& entry = tlb[tlb_index(address)];
+        if ((address & ~uint64_t(page_size - 1)) == (write ? entry.write : entry.read))
+          return reinterpret_cast<uint8_t*>(address + entry.addend);
+        return translate(address, write) + (address & (page_size - 1));
+      }
+
+     private:
+      template<typename T>
+      T load_slow(uint64_t address) {
+        check(address, sizeof(T));
+        T value;
+        if (address % sizeof(T)) {
+          uint8_t bytes[sizeof(T)];
+          for (size_t i = 0; i < sizeof(T); ++i)
+            bytes[i] = load<uint8_t>(address + i);
+          memcpy(&value, bytes, sizeof(T));
+        } else {
+          memcpy(&value, translate(address, false) + (address & (page_size - 1)), sizeof(T));
+        }
+        return value;
+      }
+
+      template<typename T>
+      void save_slow(uint64_t address, T value) {
+        check(address, sizeof(T));
+        if (address % sizeof(T)) {
+          uint8_t bytes[sizeof(T)];
+          memcpy(bytes, &value, sizeof(T));
+          for (size_t i = 0; i < sizeof(T); ++i)
+            save<uint8_t>(address + i, bytes[i]);
+        } else {
+          memcpy(translate(address, true) + (address & (page_size - 1)), &value, sizeof(T));
+        }
+      }
+
+      void check(uint64_t address, size_t size) const {
+        if (address >= limit || size > limit - address)
+          throw trap_error("memory fault");
+      }
+
+      // Хост-адрес страницы и заполнение записи TLB.
+      uint8_t* translate(uint64_t address, bool write) {
+        static const page_t zero = {};
+
+        uint64_t page = address & ~uint64_t(page_size - 1);
+        auto& entry = tlb[tlb_index(address)];
+        uint8_t* host;
+
+        if (page < stack->capacity()) {
+          host = stack->reach(page, page_size);
+          entry = { page, page, 0, 0 };
+        } else if (auto it = pages.find(page); it != pages.end()) {
+          host = it->second->data();
+          entry = { page, page, 0, 0 };
+        } else if (auto shared = base ? base->find(page) : shared_map_t::const_iterator(); base && shared != base->end()) {
+          if (write) {
+            host = pages.emplace(page, std::make_unique<page_t>(*shared->second)).first->second->data();
+            entry = { page, page, 0, 0 };
+          } else {
+            host = const_cast<uint8_t*>(shared->second->data());
+            entry = { page, tlb_invalid, 0, 0 };
+          }
+        } else if (write) {
+          host = pages.emplace(page, std::make_unique<page_t>()).first->second->data();
+          entry = { page, page, 0, 0 };
+        } else {
+          host = const_cast<uint8_t*>(zero.data());
+          entry = { page, tlb_invalid, 0, 0 };
+        }
+
+        entry.addend = reinterpret_cast<intptr_t>(host) - static_cast<intptr_t>(page);
+        return host;
+      }
+
+      std::array<tlb_entry_t, tlb_size>                        tlb;
+      stack_t*                                                 stack = nullptr;
+      uint64_t                                                 limit = 0;
+      std::unordered_map<uint64_t, std::unique_ptr<page_t>>    pages;
+      std::shared_ptr<const shared_map_t>                      base;
+    };
+
+    struct vm_t;
+
+    // Обработчик вызова хоста: context - указанный при bind, args - аргументы прямо
+    // в памяти гостя (R1..R8 фрейма у HCALL, слова 1..6 записи у HBATCH).
+    using host_fn_t = reg_value_t (*)(vm_t& vm, void* context, const reg_value_t* args);
+
+    // Таблица вызовов хоста по номеру: HCALL стоит одного косвенного вызова.
+    // Номер 0 зарезервирован под конец пакета HBATCH.
+    class host_t {
+     public:
+      static constexpr size_t size = 256;
+
+      void bind(uint64_t id, host_fn_t fn, void* context = nullptr) {
+        if (!id || id >= size)
+          throw fatal_error("host call id out of range");
+        entries[id] = { fn, context };
+      }
+
+      reg_value_t call(vm_t& vm, uint64_t id, const reg_value_t* args) const {
+        if (id >= size || !entries[id].fn) [[unlikely]]
+          throw trap_error("unknown host call");
+        return entries[id].fn(vm, entries[id].context, args);
+      }
+
+     private:
+      struct entry_t {
+        host_fn_t fn      = nullptr;
+        void*     context = nullptr;
+      };
+
+      std::array<entry_t, size> entries = {};
+    };
+
+    struct vm_t {
+      stack_t          stack;
+      memory_t         memory;
+      registers_set_t* registers_set;
+      bool             halted;
+      uint64_t         steps;
+      size_t           depth;
+      size_t           max_depth;
+      uint64_t         limit   = steps_unlimited;   // шаг, на котором исполнитель возвращает управление
+      bool             yielded = false;             // остановка по YIELD
+      profiler_t*      profiler = nullptr;
+      const host_t*    host     = nullptr;
+    };
+
+    using handler_fn_t = void (*)(vm_t&, const decoded_instruction_t&);
+
+    std::string print_stack(const stack_t& stack, registers_set_t* registers_set) {
+      std::stringstream ss;
+      ss << std::endl;
+
+      for (uint8_t i = 0; i < 16; ++i) {
+        ss << reg_name(i) << "   " << std::hex << std::setfill('0') << std::setw(2 * sizeof(reg_value_t))
+          << (*registers_set)[i] << std::endl;
+      }
+
+      ss << "size: " << (reinterpret_cast<const uint8_t*>(registers_set) - reinterpret_cast<const uint8_t*>(stack.data())) << std::endl;
+
+      for (size_t i = (*registers_set)[reg_rb]; i < static_cast<size_t>((*registers_set)[reg_rs]); ++i) {
+        ss << "stack data: " << std::hex << std::setfill('0') << std::setw(2 * sizeof(uint8_t))
+          << (uint64_t) stack.at(i) << std::endl;
+      }
+
+      return ss.str();
+    }
+
+    std::string print_profile(const profile_t& profile, size_t top = 10) {
+      std::vector<std::pair<uint64_t, uint32_t>> sorted[4];
+      for (auto [key, count] : profile.ngrams)
+        sorted[std::bit_width(key) / 8 - 1 + (std::bit_width(key) % 8 != 0)].emplace_back(count, key);
+
+      std::stringstream ss;
+      for (size_t n = 2; n <= 4; ++n) {
+        auto& ngrams = sorted[n - 1];
+        std::sort(ngrams.begin(), ngrams.end(), std::greater<>());
+        for (size_t i = 0; i < std::min(top, ngrams.size()); ++i) {
+          ss << n << "  " << std::setw(12) << std::dec << ngrams[i].first << " ";
+          for (size_t b = n; b-- > 0; )
+            ss << " " << handler_name((ngrams[i].second >> 8 * b & 0xFF) - 1);
+          ss << std::endl;
+        }
+      }
+      return ss.str();
+    }
+
+    std::string print_profiler(const profiler_t& profiler) {
+      std::vector<const profiler_t::function_t*> sorted;
+      for (const auto& function : profiler.functions) {
+        if (function.calls)
+          sorted.push_back(&function);
+      }
+      std::sort(sorted.begin(), sorted.end(), [](auto a, auto b) { return a->cycles > b->cycles; });
+
+      std::stringstream ss;
+      ss << std::setw(12) << "calls" << std::setw(14) << "instructions" << std::setw(14) << "inclusive"
+        << std::setw(14) << "cycles" << std::setw(14) << "inclusive" << "  function" << std::endl;
+      for (auto function : sorted) {
+        ss << std::setw(12) << function->calls
+          << std::setw(14) << function->instructions << std::setw(14) << function->inclusive_instructions
+          << std::setw(14) << function->cycles << std::setw(14) << function->inclusive_cycles
+          << "  " << function->name << std::endl;
+      }
+      return ss.str();
+    }
+
+    // Формат collapsed stacks (flamegraph.pl, speedscope): "f1;f2;f3 <собственные такты>".
+    std::string print_collapsed(const profiler_t& profiler) {
+      std::stringstream ss;
+      for (size_t i = 1; i < profiler.nodes.size(); ++i) {
+        if (!profiler.nodes[i].cycles)
+          continue;
+
+        std::vector<std::string_view> path;
+        for (auto node = i; node; node = profiler.nodes[node].parent)
+          path.push_back(profiler.functions[profiler.nodes[node].function].name);
+
+        for (size_t j = path.size(); j-- > 0; )
+          ss << path[j] << (j ? ";" : " ");
+        ss << profiler.nodes[i].cycles << std::endl;
+      }
+      return ss.str();
+    }
+
+    void exec_set(vm_t& vm, const decoded_instruction_t& instruction) {
+      (*vm.registers_set)[instruction.rd] = instruction.val;
+    }
+
+    void exec_and(vm_t& vm, const decoded_instruction_t& instruction) {
+      auto& regs = *vm.registers_set;
+      regs[instruction.rd] = regs[instruction.rs1] & regs[instruction.rs2];
+    }
+
+    void exec_or(vm_t& vm, const decoded_instruction_t& instruction) {
+      auto& regs = *vm.registers_set;
+      regs[instruction.rd] = regs[instruction.rs1] | regs[instruction.rs2];
+    }
+
+    void exec_xor(vm_t& vm, const decoded_instruction_t& instruction) {
+      auto& regs = *vm.registers_set;
+      regs[instruction.rd] = regs[instruction.rs1] ^ regs[instruction.rs2];
+    }
+
+    // Арифметика гостя как у code_optimizer_n::fold и x86: ADD, SUB и MULT по модулю 2^64,
+    // сдвиг на младшие 6 бит Rb. Деление на 0 и INT64_MIN / -1 - ловушка, а не SIGFPE хоста.
+    constexpr reg_value_t alu_add(reg_value_t a, reg_value_t b) {
+      return static_cast<reg_value_t>(static_cast<reg_uvalue_t>(a) + static_cast<reg_uvalue_t>(b));
+    }
+
+    constexpr reg_value_t alu_sub(reg_value_t a, reg_value_t b) {
+      return static_cast<reg_value_t>(static_cast<reg_uvalue_t>(a) - static_cast<reg_uvalue_t>(b));
+    }
+
+    constexpr reg_value_t alu_mult(reg_value_t a, reg_value_t b) {
+      return static_cast<reg_value_t>(static_cast<reg_uvalue_t>(a) * static_cast<reg_uvalue_t>(b));
+    }
+
+    constexpr bool divides(reg_value_t a, reg_value_t b) {
+      return b && !(a == std::numeric_limits<reg_value_t>::min() && b == -1);
+    }
+
+    reg_value_t alu_div(reg_value_t a, reg_value_t b) {
+      if (!divides(a, b)) [[unlikely]]
+        throw trap_error("division by zero");
+      return a / b;
+    }
+
+    constexpr reg_value_t alu_lsh(reg_value_t a, reg_value_t b) {
+      return static_cast<reg_value_t>(static_cast<reg_uvalue_t>(a) << (b & 63));
+    }
+
+    constexpr reg_value_t alu_rsh(reg_value_t a, reg_value_t b) {
+      return a >> (b & 63);
+    }
+
+    void exec_add(vm_t& vm, const decoded_instruction_t& instruction) {
+      auto& regs = *vm.registers_set;
+      regs[instruction.rd] = alu_add(regs[instruction.rs1], regs[instruction.rs2]);
+    }
+
+    void exec_sub(vm_t& vm, const decoded_instruction_t& instruction) {
+      auto& regs = *vm.registers_set;
+      regs[instruction.rd] = alu_sub(regs[instruction.rs1], regs[instruction.rs2]);
+    }
+
+    void exec_mult(vm_t& vm, const decoded_instruction_t& instruction) {
+      auto& regs = *vm.registers_set;
+      regs[instruction.rd] = alu_mult(regs[instruction.rs1], regs[instruction.rs2]);
+    }
+
+    void exec_div(vm_t& vm, const decoded_instruction_t& instruction) {
+      auto& regs = *vm.registers_set;
+      regs[instruction.rd] = alu_div(regs[instruction.rs1], regs[instruction.rs2]);
+    }
+
+    void exec_lsh(vm_t& vm, const decoded_instruction_t& instruction) {
+      auto& regs = *vm.registers_set;
+      regs[instruction.rd] = alu_lsh(regs[instruction.rs1], regs[instruction.rs2]);
+    }
+
+    void exec_rsh(vm_t& vm, const decoded_instruction_t& instruction) {
+      auto& regs = *vm.registers_set;
+      regs[instruction.rd] = alu_rsh(regs[instruction.rs1], regs[instruction.rs2]);
+    }
+
+    // Адрес перехода проверяется при выборке следующей инструкции.
+    void exec_br(vm_t& vm, const decoded_instruction_t& instruction) {
+      if ((*vm.registers_set)[instruction.rs1])
+        (*vm.registers_set)[reg_ri] = (*vm.registers_set)[instruction.rd];
+    }
+
+    void exec_not(vm_t& vm, const decoded_instruction_t& instruction) {
+      auto& regs = *vm.registers_set;
+      regs[instruction.rd] = ~regs[instruction.rs1];
+    }
+
+    // LOAD8/16/32 дополняют значение нулями, SAVE8/16/32 пишут младшие байты Rd.
+    template<typename T>
+    void exec_load(vm_t& vm, const decoded_instruction_t& instruction) {
+      auto& regs = *vm.registers_set;
+      regs[instruction.rd] = vm.memory.load<T>(regs[instruction.rs1]);
+    }
+
+    template<typename T>
+    void exec_save(vm_t& vm, const decoded_instruction_t& instruction) {
+      auto& regs = *vm.registers_set;
+      vm.memory.save<T>(regs[instruction.rs1], static_cast<T>(regs[instruction.rd]));
+    }
+
+    void exec_mov(vm_t& vm, const decoded_instruction_t& instruction) {
+      auto& regs = *vm.registers_set;
+      regs[instruction.rd] = regs[instruction.rs1];
+    }
+
+    void exec_call(vm_t& vm, const decoded_instruction_t& instruction) {
+      auto& regs = *vm.registers_set;
+      if (vm.depth == vm.max_depth)
+        throw trap_error("max call depth exceeded");
+      registers_set_t* registers_set_new = vm.stack.frame(regs[reg_rs]);
+      ++vm.depth;
+      (*registers_set_new)[reg_ri] = regs[instruction.rs1];
+      (*registers_set_new)[reg_rp] = regs[reg_rb];
+      (*registers_set_new)[reg_rb] = regs[reg_rs] + sizeof(registers_set_t);
+      (*registers_set_new)[reg_rs] = (*registers_set_new)[reg_rb];
+      vm.registers_set = registers_set_new;
+
+      if (vm.profiler)
+        vm.profiler->enter((*registers_set_new)[reg_ri], vm.steps);
+    }
+
+    void exec_ret(vm_t& vm, const decoded_instruction_t&) {
+      if (vm.profiler)
+        vm.profiler->leave(vm.steps);
+
+      auto rp = (*vm.registers_set)[reg_rp];
+      if (!rp) {
+        vm.halted = true;
+        return;
+      }
+      if (static_cast<uint64_t>(rp) > vm.stack.size() || rp < static_cast<reg_value_t>(sizeof(registers_set_t)))
+        throw trap_error("invalid RP");
+      vm.registers_set = vm.stack.frame(rp - sizeof(registers_set_t));
+      if (vm.depth)
+        --vm.depth;
+    }
+
+    // Исполнитель возвращает управление сразу после YIELD, RI уже указывает на следующую инструкцию.
+    void exec_yield(vm_t& vm, const decoded_instruction_t&) {
+      vm.yielded = true;
+      vm.limit   = vm.steps;
+    }
+
+    void exec_const(vm_t& vm, const decoded_instruction_t& instruction) {
+      (*vm.registers_set)[instruction.rd] = instruction.imm;
+    }
+
+    void exec_hcall(vm_t& vm, const decoded_instruction_t& instruction) {
+      auto& regs = *vm.registers_set;
+      if (!vm.host) [[unlikely]]
+        throw trap_error("unknown host call");
+      regs[instruction.rd] = vm.host->call(vm, regs[instruction.rs1], &regs[reg_r1]);
+    }
+
+    // Записи по 64 байта от выровненного Ra: номер, 6 аргументов, результат.
+    // Записи читаются и заполняются на месте до записи с номером 0, Rd - число выполненных.
+    void exec_hbatch(vm_t& vm, const decoded_instruction_t& instruction) {
+      static constexpr size_t record_size = 8 * sizeof(reg_value_t);
+
+      auto& regs = *vm.registers_set;
+      uint64_t address = regs[instruction.rs1];
+      if (address % record_size || !vm.host) [[unlikely]]
+        throw trap_error(vm.host ? "misaligned host batch" : "unknown host call");
+
+      reg_value_t count = 0;
+      for (;; address += record_size, ++count) {
+        auto record = reinterpret_cast<reg_value_t*>(vm.memory.reach(address, record_size, true));
+        if (!record[0])
+          break;
+        record[7] = vm.host->call(vm, record[0], record + 1);
+      }
+      regs[instruction.rd] = count;
+    }
+
+    // Вызовы хоста, которые interpreter_t связывает сам.
+    enum host_call_id_t : uint64_t {
+      host_call_write = 1,   // write(fd, address, size) -> записано байт или -errno
+    };
+
+    // Короткая запись (write вернул 0) останавливает вызов: результат - записанное
+    // до нее или -EIO, если не записано ничего.
+    reg_value_t host_write(vm_t& vm, void*, const reg_value_t* args) {
+      reg_value_t written = 0;
+      bool stopped = false;
+      vm.memory.view(args[1], args[2], false, [&](std::span<uint8_t> chunk) {
+        for (size_t done = 0; !stopped && done < chunk.size(); ) {
+          auto n = ::write(static_cast<int>(args[0]), chunk.data() + done, chunk.size() - done);
+          if (n > 0) {
+            done    += n;
+            written += n;
+          } else if (n == 0) {
+            stopped = true;
+            if (!written)
+              written = -EIO;
+          } else if (errno != EINTR) {
+            stopped = true;
+            written = -errno;
+          }
+        }
+      });
+      return written;
+    }
+
+    void exec_invalid(vm_t&, const decoded_instruction_t&) {
+      throw fatal_error("unknown cmd");
+    }
+
+    void exec_shift_in(vm_t& vm, const decoded_instruction_t& instruction) {
+      auto& regs = *vm.registers_set;
+      regs[instruction.rd] = regs[instruction.rd] << 8 | instruction.val;
+      regs[reg_rt] = instruction.val;
+    }
+
+    void exec_set64(vm_t& vm, const decoded_instruction_t& instruction) {
+      auto& regs = *vm.registers_set;
+      regs[instruction.rd] = instruction.imm;
+      regs[reg_rt] = instruction.val;
+    }
+
+    void exec_set64_call(vm_t& vm, const decoded_instruction_t& instruction) {
+      exec_set64(vm, instruction);
+      exec_call(vm, instruction);
+    }
+
+    static inline const std::array<handler_fn_t, handlers_count> handlers_fn = {
+      exec_set,
+      exec_and,
+      exec_or,
+      exec_xor,
+      exec_add,
+      exec_sub,
+      exec_mult,
+      exec_div,
+      exec_lsh,
+      exec_rsh,
+      exec_br,
+      exec_not,
+      exec_load<uint64_t>,
+      exec_save<uint64_t>,
+      exec_mov,
+      exec_call,
+      exec_ret,
+      exec_load<uint8_t>,
+      exec_load<uint16_t>,
+      exec_load<uint32_t>,
+      exec_save<uint8_t>,
+      exec_save<uint16_t>,
+      exec_save<uint32_t>,
+      exec_yield,
+      exec_const,
+      exec_hcall,
+      exec_hbatch,
+      exec_invalid,
+      exec_shift_in,
+      exec_set64,
+      exec_set64_call,
+    };
+
+    const std::string& engine_name(engine_t engine) {
+      static const std::vector<std::string> names = { "table", "threaded", "jit", "block" };
+      return names.at(static_cast<size_t>(engine));
+    }
+
+    engine_t engine_index(const std::string& name) {
+      if (name == "table")
+        return engine_t::table;
+      if (name == "threaded")
+        return engine_t::threaded;
+      if (name == "jit")
+        return engine_t::jit;
+      if (name == "block")
+        return engine_t::block;
+      throw fatal_error("unknown engine");
+    }
+
+    size_t text_index(const decoded_text_t& decoded, reg_value_t ri) {
+      size_t index = ri / sizeof(instruction_t);
+      if (ri % sizeof(instruction_t) || index >= decoded.size())
+        throw fatal_error("invalid RI");
+      return index;
+    }
+
+    // Корневой фрейм начинает исполнение с адреса entry.
+    void init(vm_t& vm, reg_value_t entry, const options_t& options = {}) {
+      vm.stack.reserve(options.stack_size);
+      vm.memory.init(&vm.stack, std::max<uint64_t>(options.memory_size, vm.stack.capacity()));
+      vm.halted    = false;
+      vm.steps     = 0;
+      vm.depth     = 0;
+      vm.max_depth = options.max_depth;
+      vm.host      = options.host;
+      vm.limit     = steps_unlimited;
+      vm.yielded   = false;
+
+      vm.registers_set = vm.stack.frame(0);
+      (*vm.registers_set)[reg_rp] = 0;
+      (*vm.registers_set)[reg_ri] = entry;
+      (*vm.registers_set)[reg_rb] = sizeof(registers_set_t);
+      (*vm.registers_set)[reg_rs] = (*vm.registers_set)[reg_rb];
+    }
+
+    void init(vm_t& vm, const functions_t& functions, const options_t& options = {}) {
+      auto it = functions.find("__start");
+      if (it == functions.end())
+        throw fatal_error("__start not exists");
+      init(vm, it->second, options);
+    }
+
+    void run_table(vm_t& vm, const decoded_text_t& decoded, bool trace,
+        profile_t* profile = nullptr, trace_writer_t* writer = nullptr) {
+      while (!vm.halted && vm.steps < vm.limit) {
+        // RI указывает на следующую инструкцию до ее исполнения:
+        // CALL и RET работают с уже продвинутым адресом возврата.
+        auto& ri = (*vm.registers_set)[reg_ri];
+        auto pc = ri;
+        const auto& instruction = decoded[text_index(decoded, ri)];
+        ri += instruction.length * sizeof(instruction_t);
+        vm.steps += instruction.length;
+        handlers_fn[instruction.handler](vm, instruction);
+
+        if (writer) {
+          trace_record_t record = { static_cast<uint32_t>(pc), instruction.raw.value, trace_no_reg, instruction.length, 0 };
+          if (instruction.handler == handler_call || instruction.handler == handler_ret
+              || instruction.handler == handler_set64_call)
+            record.reg = reg_rb;
+          else if (writes_rd(instruction.handler))
+            record.reg = instruction.rd;
+          if (record.reg != trace_no_reg)
+            record.value = (*vm.registers_set)[record.reg];
+          writer->push(record);
+        }
+
+        if (profile) {
+          profile->record(instruction.handler);
+          if (instruction.handler == handler_call || instruction.handler == handler_ret
+              || instruction.handler == handler_set64_call)
+            profile->reset();
+        }
+
+        if (trace) {
+          DEBUG_LOGGER_VERBOSE_EXEC("instruction: '%s'", print_instruction(instruction.raw).c_str());
+          DEBUG_LOGGER_VERBOSE_EXEC("stack frame: '%s'", print_stack(vm.stack, vm.registers_set).c_str());
+        }
+      }
+    }
+
+    // CALL, BR и RET меняют RI, SAVE и вызовы хоста могут записать слот RI фрейма.
+    constexpr bool moves_ri(uint8_t handler) {
+      switch (handler) {
+        case handler_hcall:
+        case handler_hbatch:
+        case handler_br:
+        case handler_call:
+        case handler_ret:
+        case handler_set64_call:
+          return true;
+        default:
+          return memory_width(handler) && !writes_rd(handler);
+      }
+    }
+
+    // run_table для текста, принятого semantic_analyzer_n::verify с verified: инструкции
+    // известны, текст кончается RET, RI пишут только переходы. Выборка идет без проверки
+    // индекса, RI проверяется на входе и после moves_ri. Без трассировки и профиля.
+    void run_unchecked(vm_t& vm, const decoded_text_t& decoded) {
+      text_index(decoded, (*vm.registers_set)[reg_ri]);
+      while (!vm.halted && vm.steps < vm.limit) {
+        auto& ri = (*vm.registers_set)[reg_ri];
+        const auto& instruction = decoded[static_cast<reg_uvalue_t>(ri) / sizeof(instruction_t)];
+        ri += instruction.length * sizeof(instruction_t);
+        vm.steps += instruction.length;
+        handlers_fn[instruction.handler](vm, instruction);
+        if (moves_ri(instruction.handler) && !vm.halted) [[unlikely]]
+          text_index(decoded, (*vm.registers_set)[reg_ri]);
+      }
+    }
+
+    struct threaded_cell_t {
+      const void*           label;
+      decoded_instruction_t instruction;
+    };
+
+    // Текст для run_threaded: ячейка на инструкцию и завершающая op_end.
+    // Не зависит от VM, поэтому строится один раз на программу.
+    using threaded_code_t = std::vector<threaded_cell_t>;
+
+#if defined(__GNUC__)
+    // Регистры текущего фрейма живут в локальном массиве и сбрасываются в стек
+    // только в медленном пути: CALL, RET и инструкции, которые трогают RI
+    // или еще не поддержаны в быстром пути. LOAD/SAVE по адресам регистров
+    // текущего фрейма тоже уходят в медленный путь.
+    // Адреса меток известны только внутри функции: без machine она лишь возвращает
+    // их таблицу для translate_threaded (медленный путь и op_end - в конце таблицы).
+    const void* const* run_threaded(vm_t* machine, const decoded_text_t& decoded, const threaded_code_t& code) {
+      static const std::array<const void*, handlers_count + 2> labels = {
+        &&op_set,  &&op_and,  &&op_or,   &&op_xor,  &&op_add,  &&op_sub,
+        &&op_mult, &&op_div,  &&op_lsh,  &&op_rsh,  &&op_br,   &&op_not,
+        &&op_load64, &&op_save64, &&op_mov, &&op_slow, &&op_slow,
+        &&op_load8, &&op_load16, &&op_load32, &&op_save8, &&op_save16, &&op_save32,
+        &&op_slow, &&op_const, &&op_slow, &&op_slow, &&op_slow, &&op_shift_in, &&op_set64,
+        &&op_slow, &&op_slow, &&op_end,
+      };
+
+      if (!machine)
+        return labels.data();
+
+      auto& vm = *machine;
+      reg_value_t regs[16];
+      uint64_t steps = 0;
+      uint64_t frame = 0;   // адрес регистров текущего фрейма в памяти гостя
+      uint64_t memory = vm.memory.size_limit();
+      const threaded_cell_t* ip = nullptr;
+
+      if (vm.steps >= vm.limit)
+        return nullptr;
+
+      memcpy(regs, *vm.registers_set, sizeof(regs));
+      frame = reinterpret_cast<uint8_t*>(vm.registers_set) - vm.stack.data();
+      ip = code.data() + text_index(decoded, regs[reg_ri]);
+
+#define THREADED_DISPATCH()   goto *ip->label
+#define THREADED_NEXT()       do { ++ip; ++steps; THREADED_DISPATCH(); } while (false)
+#define THREADED_SKIP()       do { steps += ip->instruction.length; ip += ip->instruction.length; THREADED_DISPATCH(); } while (false)
+#define THREADED_OP3(name, op)                                                          \
+      name: {                                                                           \
+        const auto& instruction = ip->instruction;                                      \
+        regs[instruction.rd] = op(regs[instruction.rs1], regs[instruction.rs2]);        \
+        THREADED_NEXT();                                                                \
+      }
+#define THREADED_FRAME(address)                                                         \
+      (static_cast<uint64_t>(address) - frame + sizeof(reg_value_t) - 1                 \
+        < sizeof(registers_set_t) + sizeof(reg_value_t) - 1)
+// слот фрейма или ловушка памяти - через op_slow, как у DIV
+#define THREADED_SLOW(address, type)                                                    \
+      (THREADED_FRAME(address) || static_cast<uint64_t>(address) > memory - sizeof(type))
+#define THREADED_LOAD(name, type)                                                       \
+      name: {                                                                           \
+        const auto& instruction = ip->instruction;                                      \
+        if (THREADED_SLOW(regs[instruction.rs1], type))                                 \
+          goto op_slow;                                                                 \
+        regs[instruction.rd] = vm.memory.load<type>(regs[instruction.rs1]);             \
+        THREADED_NEXT();                                                                \
+      }
+#define THREADED_SAVE(name, type)                                                       \
+      name: {                                                                           \
+        const auto& instruction = ip->instruction;                                      \
+        if (THREADED_SLOW(regs[instruction.rs1], type))                                 \
+          goto op_slow;                                                                 \
+        vm.memory.save<type>(regs[instruction.rs1], static_cast<type>(regs[instruction.rd])); \
+        THREADED_NEXT();                                                                \
+      }
+
+      THREADED_DISPATCH();
+
+      op_set: {
+        regs[ip->instruction.rd] = ip->instruction.val;
+        THREADED_NEXT();
+      }
+
+      THREADED_OP3(op_and,  std::bit_and<reg_value_t>())
+      THREADED_OP3(op_or,   std::bit_or<reg_value_t>())
+      THREADED_OP3(op_xor,  std::bit_xor<reg_value_t>())
+      THREADED_OP3(op_add,  alu_add)
+      THREADED_OP3(op_sub,  alu_sub)
+      THREADED_OP3(op_mult, alu_mult)
+      THREADED_OP3(op_lsh,  alu_lsh)
+      THREADED_OP3(op_rsh,  alu_rsh)
+
+      // ловушка деления - через op_slow, чтобы регистры и шаги дошли до vm
+      op_div: {
+        const auto& instruction = ip->instruction;
+        if (!divides(regs[instruction.rs1], regs[instruction.rs2])) [[unlikely]]
+          goto op_slow;
+        regs[instruction.rd] = regs[instruction.rs1] / regs[instruction.rs2];
+        THREADED_NEXT();
+      }
+
+      THREADED_LOAD(op_load8,  uint8_t)
+      THREADED_LOAD(op_load16, uint16_t)
+      THREADED_LOAD(op_load32, uint32_t)
+      THREADED_LOAD(op_load64, uint64_t)
+      THREADED_SAVE(op_save8,  uint8_t)
+      THREADED_SAVE(op_save16, uint16_t)
+      THREADED_SAVE(op_save32, uint32_t)
+      THREADED_SAVE(op_save64, uint64_t)
+
+      op_not: {
+        regs[ip->instruction.rd] = ~regs[ip->instruction.rs1];
+        THREADED_NEXT();
+      }
+
+      op_mov: {
+        regs[ip->instruction.rd] = regs[ip->instruction.rs1];
+        THREADED_NEXT();
+      }
+
+      // Переход внутри текста без выхода из цикла, остальное (неверный адрес,
+      // граница отрезка шагов) - через медленный путь.
+      op_br: {
+        const auto& instruction = ip->instruction;
+        if (!regs[instruction.rs1])
+          THREADED_NEXT();
+        auto target = static_cast<uint64_t>(regs[instruction.rd]);
+        if (target % sizeof(instruction_t) || target / sizeof(instruction_t) >= decoded.size()
+            || vm.steps + steps + 1 >= vm.limit)
+          goto op_slow;
+        ++steps;
+        ip = code.data() + target / sizeof(instruction_t);
+        THREADED_DISPATCH();
+      }
+
+      op_shift_in: {
+        regs[ip->instruction.rd] = regs[ip->instruction.rd] << 8 | ip->instruction.val;
+        regs[reg_rt] = ip->instruction.val;
+        THREADED_SKIP();
+      }
+
+      op_set64: {
+        regs[ip->instruction.rd] = ip->instruction.imm;
+        regs[reg_rt] = ip->instruction.val;
+        THREADED_SKIP();
+      }
+
+      op_const: {
+        regs[ip->instruction.rd] = ip->instruction.imm;
+        THREADED_NEXT();
+      }
+
+      op_slow: {
+        regs[reg_ri] = (ip - code.data() + ip->instruction.length) * sizeof(instruction_t);
+        memcpy(*vm.registers_set, regs, sizeof(regs));
+        vm.steps += steps + ip->instruction.length;
+        steps = 0;
+        handlers_fn[ip->instruction.handler](vm, ip->instruction);
+        if (vm.halted || vm.steps >= vm.limit)
+          goto done;
+        memcpy(regs, *vm.registers_set, sizeof(regs));
+        frame = reinterpret_cast<uint8_t*>(vm.registers_set) - vm.stack.data();
+        ip = code.data() + text_index(decoded, regs[reg_ri]);
+        THREADED_DISPATCH();
+      }
+
+      op_end: {
+        regs[reg_ri] = (ip - code.data()) * sizeof(instruction_t);
+        memcpy(*vm.registers_set, regs, sizeof(regs));
+        vm.steps += steps;
+        throw fatal_error("invalid RI");
+      }
+
+#undef THREADED_SAVE
+#undef THREADED_LOAD
+#undef THREADED_SLOW
+#undef THREADED_FRAME
+#undef THREADED_OP3
+#undef THREADED_SKIP
+#undef THREADED_NEXT
+#undef THREADED_DISPATCH
+
+    done:
+      vm.steps += steps;
+      return nullptr;
+    }
+
+    void translate_threaded(threaded_code_t& code, const decoded_text_t& decoded) {
+      static const auto labels = run_threaded(nullptr, {}, {});
+      code.resize(decoded.size() + 1);
+      for (size_t i = 0; i < decoded.size(); ++i) {
+        code[i].label       = labels[uses_register(decoded[i], reg_ri) ? size_t(handlers_count) : decoded[i].handler];
+        code[i].instruction = decoded[i];
+      }
+      code.back().label = labels[handlers_count + 1];
+    }
+#else
+    const void* const* run_threaded(vm_t* vm, const decoded_text_t& decoded, const threaded_code_t&) {
+      run_table(*vm, decoded, false);
+      return nullptr;
+    }
+
+    void translate_threaded(threaded_code_t& code, const decoded_text_t&) {
+      code.clear();
+    }
+#endif
+
+    void run_threaded(vm_t& vm, const decoded_text_t& decoded) {
+      threaded_code_t code;
+      translate_threaded(code, decoded);
+      run_threaded(&vm, decoded, code);
+    }
+
+    // Базовый блок: инструкции [begin, last] подряд, переход только последней.
+    // next - блок, следующий за last в тексте, связывается при разбиении.
+    struct block_t {
+      uint32_t begin;
+      uint32_t last;
+      uint32_t next;    // номер блока + 1, 0 - нет
+      uint64_t steps;   // сумма length инструкций блока
+    };
+
+    // Блоки начинаются на функциях, метках и после переходов.
+    // starts: индекс инструкции -> номер блока + 1, 0 - не начало блока.
+    struct blocks_t {
+      std::vector<block_t>  blocks;
+      std::vector<uint32_t> starts;
+    };
+
+    // Конец блока: передача управления, инструкция с регистром RI или запись, которая
+    // может попасть в слот RI фрейма (SAVE*, вызовы хоста) - RI перечитывается после нее.
+    bool ends_block(const decoded_instruction_t& instruction) {
+      switch (instruction.handler) {
+        case handler_yield:
+        case handler_invalid:
+          return true;
+        default:
+          return uses_register(instruction, reg_ri) || moves_ri(instruction.handler);
+      }
+    }
+
+    void split_blocks(blocks_t& blocks, const decoded_text_t& decoded, const functions_t& functions) {
+      blocks.blocks.clear();
+      blocks.starts.assign(decoded.size(), 0);
+      if (decoded.empty())
+        return;
+
+      std::vector<bool> leaders(decoded.size() + 1);
+      leaders[0] = true;
+      for (const auto& [name, address] : functions)
+        if (address % sizeof(instruction_t) == 0 && address / sizeof(instruction_t) < decoded.size())
+          leaders[address / sizeof(instruction_t)] = true;
+      for (size_t i = 0; i < decoded.size(); ++i)
+        if (ends_block(decoded[i]))
+          leaders[std::min(i + decoded[i].length, decoded.size())] = true;
+
+      for (size_t i = 0; i < decoded.size(); ++i) {
+        if (!leaders[i])
+          continue;
+        block_t block = { static_cast<uint32_t>(i), 0, 0, 0 };
+        for (size_t j = i;;) {
+          block.steps += decoded[j].length;
+          size_t next = j + decoded[j].length;
+          if (ends_block(decoded[j]) || next >= decoded.size() || leaders[next]) {
+            block.last = static_cast<uint32_t>(j);
+            break;
+          }
+          j = next;
+        }
+        blocks.blocks.push_back(block);
+        blocks.starts[i] = static_cast<uint32_t>(blocks.blocks.size());
+      }
+
+      for (auto& block : blocks.blocks) {
+        size_t next = block.last + decoded[block.last].length;
+        if (next < decoded.size())
+          block.next = blocks.starts[next];
+      }
+    }
+
+    // Каждая инструкция блока по-прежнему вызывается через handlers_fn, но без
+    // выборки и проверки RI и без проверки бюджета между инструкциями: RI и steps
+    // продвигаются сразу на весь блок, бюджет проверяется на границе блока. Следующий блок -
+    // сначала связанный next, иначе поиск по starts. Вход в середину блока
+    // (возврат после CALL внутри слитой инструкции, ручной RI) исполняется по одной
+    // инструкции до ближайшего начала блока. Ловушка посреди блока возвращает
+    // RI и steps к инструкции с ловушкой, как у table.
+    void run_block(vm_t& vm, const decoded_text_t& decoded, const blocks_t& blocks) {
+      const block_t* block = nullptr;
+      while (!vm.halted && vm.steps < vm.limit) {
+        auto& ri = (*vm.registers_set)[reg_ri];
+        size_t index = text_index(decoded, ri);
+        uint32_t id = block && block->next && blocks.blocks[block->next - 1].begin == index
+          ? block->next : blocks.starts[index];
+
+        if (!id) {
+          block = nullptr;
+          const auto& instruction = decoded[index];
+          ri += instruction.length * sizeof(instruction_t);
+          vm.steps += instruction.length;
+          handlers_fn[instruction.handler](vm, instruction);
+          continue;
+        }
+
+        block = &blocks.blocks[id - 1];
+        ri = (block->last + decoded[block->last].length) * sizeof(instruction_t);
+        vm.steps += block->steps;
+        size_t i = block->begin;
+        try {
+          for (; i < block->last; i += decoded[i].length)
+            handlers_fn[decoded[i].handler](vm, decoded[i]);
+          handlers_fn[decoded[block->last].handler](vm, decoded[block->last]);
+        } catch (...) {
+          ri = (i + decoded[i].length) * sizeof(instruction_t);
+          for (i += decoded[i].length; i <= block->last; i += decoded[i].length)
+            vm.steps -= decoded[i].length;
+          throw;
+        }
+      }
+    }
+
+#if defined(__x86_64__)
+    // Базовый JIT: каждая функция из functions_t транслируется от входа до первого RET
+    // в машинный код x86-64. Фрейм закреплен в rbx, vm_t* - в r12, jit_t* - в r13,
+    // регистры гостя читаются и пишутся прямо в registers_set_t на стеке VM,
+    // поэтому фреймы JIT и интерпретатора взаимозаменяемы.
+    // LOAD/SAVE проверяют TLB прямо в машинном коде, промах уходит в jit_handler,
+    // туда же - DIV с делителем 0 или -1. Перед вызовом, который может закончиться
+    // ловушкой, шаги сбрасываются в vm.steps. SAVE, записавший слот RI своего фрейма,
+    // выходит в интерпретатор.
+    // Функции с BR, неизвестными командами или регистром RI
+    // не компилируются и исполняются интерпретатором.
+    struct jit_t;
+
+    // 0 - фрейм дошел до своего RET, иначе - выход в интерпретатор.
+    using jit_fn_t = uint64_t (*)(vm_t*, reg_value_t*, jit_t*);
+
+    // Код и точки входа разделяются копиями, у каждой копии свое состояние вызовов.
+    struct jit_t {
+      const decoded_text_t*                        decoded = nullptr;
+      std::shared_ptr<const std::vector<jit_fn_t>> entries;
+      std::shared_ptr<const void>                  storage;
+      size_t                      compiled = 0;
+      size_t                      fallback = 0;
+      std::exception_ptr          error;
+      size_t                      nesting     = 0;      // вложенность jit_call на стеке хоста
+      size_t                      max_nesting = 1024;
+    };
+
+    struct jit_emitter_t {
+      data_t code;
+
+      void bytes(std::initializer_list<uint8_t> values) {
+        code.insert(code.end(), values);
+      }
+
+      template<typename T>
+      void imm(T value) {
+        uint8_t buf[sizeof(T)];
+        memcpy(buf, &value, sizeof(T));
+        code.insert(code.end(), buf, buf + sizeof(T));
+      }
+
+      static uint8_t disp(uint8_t reg) {
+        return reg * sizeof(reg_value_t);
+      }
+
+      // mov rax/rcx, [rbx + reg]
+      void load(uint8_t host, uint8_t reg) { bytes({ 0x48, 0x8B, uint8_t(0x43 | host << 3), disp(reg) }); }
+      // mov [rbx + reg], rax
+      void store(uint8_t reg)              { bytes({ 0x48, 0x89, 0x43, disp(reg) }); }
+      // op rax, [rbx + reg]
+      void alu(uint8_t opcode, uint8_t reg) { bytes({ 0x48, opcode, 0x43, disp(reg) }); }
+
+      // mov qword [rbx + reg], value
+      void set(uint8_t reg, int64_t value) {
+        if (value >= std::numeric_limits<int32_t>::min() && value <= std::numeric_limits<int32_t>::max()) {
+          bytes({ 0x48, 0xC7, 0x43, disp(reg) });
+          imm<int32_t>(value);
+        } else {
+          bytes({ 0x48, 0xB8 });
+          imm<int64_t>(value);
+          store(reg);
+        }
+      }
+
+      // add qword [r12 + offsetof(vm_t, steps)], count
+      void steps(int32_t count) {
+        if (!count)
+          return;
+        bytes({ 0x49, 0x81, 0x84, 0x24 });
+        imm<int32_t>(offsetof(vm_t, steps));
+        imm<int32_t>(count);
+      }
+
+      void prologue() {
+        bytes({ 0x53, 0x41, 0x54, 0x41, 0x55 });   // push rbx; push r12; push r13
+        bytes({ 0x49, 0x89, 0xFC });               // mov r12, rdi
+        bytes({ 0x48, 0x89, 0xF3 });               // mov rbx, rsi
+        bytes({ 0x49, 0x89, 0xD5 });               // mov r13, rdx
+      }
+
+      void epilogue() {
+        bytes({ 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3 });   // pop r13; pop r12; pop rbx; ret
+      }
+
+      // Вызов, который может закончиться ловушкой: шаги до инструкции включительно
+      // попадают в vm.steps до вызова и снимаются после, если вызов вернулся.
+      void slow_call(const void* helper, const decoded_instruction_t* instruction, uint32_t pending) {
+        steps(pending);
+        call(helper, instruction);
+        steps(-static_cast<int32_t>(pending));
+      }
+
+      // helper(vm, jit, instruction), при ненулевом результате - выход из функции
+      void call(const void* helper, const decoded_instruction_t* instruction) {
+        bytes({ 0x4C, 0x89, 0xE7 });   // mov rdi, r12
+        bytes({ 0x4C, 0x89, 0xEE });   // mov rsi, r13
+        bytes({ 0x48, 0xBA });         // mov rdx, instruction
+        imm(reinterpret_cast<uint64_t>(instruction));
+        bytes({ 0x48, 0xB8 });         // mov rax, helper
+        imm(reinterpret_cast<uint64_t>(helper));
+        bytes({ 0xFF, 0xD0 });         // call rax
+        bytes({ 0x85, 0xC0, 0x74, 0x06 });   // test eax, eax; jz +6
+        epilogue();
+      }
+
+      // jcc/jmp rel8 вперед, смещение заполняет bind()
+      size_t jump(uint8_t opcode) {
+        bytes({ opcode, 0 });
+        return code.size() - 1;
+      }
+
+      void bind(size_t at) {
+        auto offset = code.size() - (at + 1);
+        if (offset > std::numeric_limits<int8_t>::max())
+          throw fatal_error("jit jump out of range");
+        code[at] = offset;
+      }
+
+      // rax = адрес гостя из reg, при попадании в TLB rax - хост-адрес, иначе переход
+      // на возвращенную метку. tag - смещение тега read или write в tlb_entry_t.
+      size_t translate(uint8_t reg, size_t width, size_t tag) {
+        auto tlb = offsetof(vm_t, memory) + memory_t::tlb_offset();
+        load(0, reg);
+        bytes({ 0x48, 0x89, 0xC1 });                                          // mov rcx, rax
+        bytes({ 0x48, 0xC1, 0xE9, memory_t::page_bits });                     // shr rcx, page_bits
+        bytes({ 0x83, 0xE1, memory_t::tlb_size - 1 });                        // and ecx, tlb_size - 1
+        bytes({ 0xC1, 0xE1, 5 });                                             // shl ecx, 5
+        bytes({ 0x48, 0x89, 0xC2 });                                          // mov rdx, rax
+        bytes({ 0x48, 0x81, 0xE2 });                                          // and rdx, mask
+        imm<int32_t>(~int32_t(memory_t::page_size - 1) | int32_t(width - 1));
+        bytes({ 0x49, 0x3B, 0x94, 0x0C });                                    // cmp rdx, [r12 + rcx + tag]
+        imm<int32_t>(tlb + tag);
+        auto miss = jump(0x75);                                               // jne miss
+        bytes({ 0x49, 0x03, 0x84, 0x0C });                                    // add rax, [r12 + rcx + addend]
+        imm<int32_t>(tlb + offsetof(memory_t::tlb_entry_t, addend));
+        return miss;
+      }
+    };
+
+    bool jit_frame(jit_t& jit, vm_t& vm);
+
+    // Промах TLB в LOAD/SAVE или особый делитель DIV: обычный обработчик,
+    // ловушка - выход из JIT.
+    uint64_t jit_handler(vm_t* vm, jit_t* jit, const decoded_instruction_t* instruction) {
+      try {
+        handlers_fn[instruction->handler](*vm, *instruction);
+        return 0;
+      } catch (...) {
+        jit->error = std::current_exception();
+        return 1;
+      }
+    }
+
+    // CALL из машинного кода: новый фрейм исполняется до своего RET,
+    // затем проверяется, что управление вернулось в тот же фрейм и на тот же адрес.
+    // Каждый вложенный вызов занимает стек хоста, поэтому глубже max_nesting
+    // исполнение выходит из JIT и продолжается из run_jit с нового фрейма.
+    uint64_t jit_call(vm_t* vm, jit_t* jit, const decoded_instruction_t* instruction) {
+      try {
+        auto caller = vm->registers_set;
+        auto ri = (*caller)[reg_ri];
+        exec_call(*vm, *instruction);
+        if (jit->nesting == jit->max_nesting || vm->steps >= vm->limit)
+          return 1;
+
+        ++jit->nesting;
+        bool returned = jit_frame(*jit, *vm);
+        --jit->nesting;
+        if (!returned)
+          return 1;
+        return vm->halted || vm->registers_set != caller || (*caller)[reg_ri] != ri;
+      } catch (...) {
+        // исключение не может пройти через кадры без unwind-информации
+        jit->error = std::current_exception();
+        return 1;
+      }
+    }
+
+    // Исполняет текущий фрейм до его RET: машинным кодом, если вход скомпилирован,
+    // иначе интерпретатором. false - состояние VM ушло из-под контроля JIT.
+    bool jit_frame(jit_t& jit, vm_t& vm) {
+      const auto& decoded = *jit.decoded;
+      auto frame = vm.registers_set;
+
+      if (auto fn = (*jit.entries)[text_index(decoded, (*frame)[reg_ri])]) {
+        if (fn(&vm, *frame, &jit))
+          return false;
+        exec_ret(vm, {});
+        return true;
+      }
+
+      while (true) {
+        auto& ri = (*vm.registers_set)[reg_ri];
+        const auto& instruction = decoded[text_index(decoded, ri)];
+        ri += instruction.length * sizeof(instruction_t);
+        vm.steps += instruction.length;
+
+        if (instruction.handler == handler_call || instruction.handler == handler_set64_call) {
+          if (instruction.handler == handler_set64_call)
+            exec_set64(vm, instruction);
+          if (jit_call(&vm, &jit, &instruction))
+            return false;
+        } else {
+          handlers_fn[instruction.handler](vm, instruction);
+          if (vm.halted || vm.registers_set != frame)
+            return instruction.handler == handler_ret;
+          if (vm.steps >= vm.limit)
+            return false;
+        }
+      }
+    }
+
+    bool jit_translate(jit_emitter_t& emitter, const decoded_text_t& decoded, size_t index) {
+      static constexpr std::array<uint8_t, handlers_count> alu_opcodes = {
+        0, 0x23, 0x0B, 0x33, 0x03, 0x2B,   // SET AND OR XOR ADD SUB
+      };
+
+      emitter.prologue();
+
+      uint32_t steps = 0;
+      for (; index < decoded.size(); ++index) {
+        const auto& instruction = decoded[index];
+        if (uses_register(instruction, reg_ri))
+          return false;
+
+        steps += instruction.length;
+        switch (instruction.handler) {
+          case handler_set:
+            emitter.set(instruction.rd, instruction.val);
+            break;
+
+          case handler_shift_in:
+            emitter.load(0, instruction.rd);
+            emitter.bytes({ 0x48, 0xC1, 0xE0, 0x08 });   // shl rax, 8
+            emitter.bytes({ 0x48, 0x0D });               // or rax, val
+            emitter.imm<int32_t>(instruction.val);
+            emitter.store(instruction.rd);
+            emitter.set(reg_rt, instruction.val);
+            break;
+
+          case handler_set64:
+            emitter.set(instruction.rd, instruction.imm);
+            emitter.set(reg_rt, instruction.val);
+            break;
+
+          case handler_const:
+            emitter.set(instruction.rd, instruction.imm);
+            break;
+
+          case handler_and:
+          case handler_or:
+          case handler_xor:
+          case handler_add:
+          case handler_sub:
+            emitter.load(0, instruction.rs1);
+            emitter.alu(alu_opcodes[instruction.handler], instruction.rs2);
+            emitter.store(instruction.rd);
+            break;
+
+          case handler_mult:
+            emitter.load(0, instruction.rs1);
+            emitter.bytes({ 0x48, 0x0F, 0xAF, 0x43, jit_emitter_t::disp(instruction.rs2) });   // imul rax, [rbx + rs2]
+            emitter.store(instruction.rd);
+            break;
+
+          case handler_div: {
+            emitter.load(1, instruction.rs2);
+            emitter.bytes({ 0x48, 0x8D, 0x51, 0x01 });   // lea rdx, [rcx + 1]
+            emitter.bytes({ 0x48, 0x83, 0xFA, 0x01 });   // cmp rdx, 1
+            auto special = emitter.jump(0x76);           // jbe special: делитель 0 или -1
+            emitter.load(0, instruction.rs1);
+            emitter.bytes({ 0x48, 0x99 });               // cqo
+            emitter.bytes({ 0x48, 0xF7, 0xF9 });         // idiv rcx
+            emitter.store(instruction.rd);
+            auto done = emitter.jump(0xEB);
+            emitter.bind(special);
+            emitter.slow_call(reinterpret_cast<const void*>(jit_handler), &instruction, steps);
+            emitter.bind(done);
+            break;
+          }
+
+          case handler_lsh:
+          case handler_rsh:
+            emitter.load(1, instruction.rs2);
+            emitter.load(0, instruction.rs1);
+            emitter.bytes({ 0x48, 0xD3, uint8_t(instruction.handler == handler_lsh ? 0xE0 : 0xF8) });   // shl/sar rax, cl
+            emitter.store(instruction.rd);
+            break;
+
+          case handler_not:
+            emitter.load(0, instruction.rs1);
+            emitter.bytes({ 0x48, 0xF7, 0xD0 });   // not rax
+            emitter.store(instruction.rd);
+            break;
+
+          case handler_mov:
+            emitter.load(0, instruction.rs1);
+            emitter.store(instruction.rd);
+            break;
+
+          case handler_load8:
+          case handler_load16:
+          case handler_load32:
+          case handler_load: {
+            auto width = memory_width(instruction.handler);
+            auto miss = emitter.translate(instruction.rs1, width, offsetof(memory_t::tlb_entry_t, read));
+            switch (width) {
+              case 1:  emitter.bytes({ 0x0F, 0xB6, 0x00 }); break;   // movzx eax, byte [rax]
+              case 2:  emitter.bytes({ 0x0F, 0xB7, 0x00 }); break;   // movzx eax, word [rax]
+              case 4:  emitter.bytes({ 0x8B, 0x00 });       break;   // mov eax, [rax]
+              default: emitter.bytes({ 0x48, 0x8B, 0x00 }); break;   // mov rax, [rax]
+            }
+            emitter.store(instruction.rd);
+            auto done = emitter.jump(0xEB);
+            emitter.bind(miss);
+            emitter.slow_call(reinterpret_cast<const void*>(jit_handler), &instruction, steps);
+            emitter.bind(done);
+            break;
+          }
+
+          case handler_save8:
+          case handler_save16:
+          case handler_save32:
+          case handler_save: {
+            // RI во фрейме - как у table перед исполнением; запись в слот RI
+            // меняет его, и функция уходит в интерпретатор с нового RI.
+            auto next = (index + instruction.length) * sizeof(instruction_t);
+            if (next > static_cast<size_t>(std::numeric_limits<int32_t>::max()))
+              return false;
+            emitter.set(reg_ri, next);
+            auto width = memory_width(instruction.handler);
+            auto miss = emitter.translate(instruction.rs1, width, offsetof(memory_t::tlb_entry_t, write));
+            emitter.bytes({ 0x48, 0x8B, 0x53, jit_emitter_t::disp(instruction.rd) });   // mov rdx, [rbx + rd]
+            switch (width) {
+              case 1:  emitter.bytes({ 0x88, 0x10 });       break;   // mov [rax], dl
+              case 2:  emitter.bytes({ 0x66, 0x89, 0x10 }); break;   // mov [rax], dx
+              case 4:  emitter.bytes({ 0x89, 0x10 });       break;   // mov [rax], edx
+              default: emitter.bytes({ 0x48, 0x89, 0x10 }); break;   // mov [rax], rdx
+            }
+            auto done = emitter.jump(0xEB);
+            emitter.bind(miss);
+            emitter.slow_call(reinterpret_cast<const void*>(jit_handler), &instruction, steps);
+            emitter.bind(done);
+            emitter.bytes({ 0x48, 0x81, 0x3B });   // cmp qword [rbx], next
+            emitter.imm<int32_t>(next);
+            auto same = emitter.jump(0x74);         // je same
+            emitter.steps(steps);
+            emitter.bytes({ 0xB8, 0x01, 0x00, 0x00, 0x00 });   // mov eax, 1
+            emitter.epilogue();
+            emitter.bind(same);
+            break;
+          }
+
+          case handler_set64_call:
+            emitter.set(instruction.rd, instruction.imm);
+            emitter.set(reg_rt, instruction.val);
+            [[fallthrough]];
+          case handler_call:
+            emitter.steps(steps);
+            steps = 0;
+            emitter.set(reg_ri, (index + instruction.length) * sizeof(instruction_t));
+            emitter.call(reinterpret_cast<const void*>(jit_call), &instruction);
+            break;
+
+          case handler_ret:
+            emitter.steps(steps);
+            emitter.set(reg_ri, (index + 1) * sizeof(instruction_t));
+            emitter.bytes({ 0x31, 0xC0 });   // xor eax, eax
+            emitter.epilogue();
+            return true;
+
+          default:
+            return false;
+        }
+        index += instruction.length - 1;
+      }
+
+      return false;
+    }
+
+    void jit_compile(jit_t& jit, const decoded_text_t& decoded, const functions_t& functions) {
+      auto entries = std::make_shared<std::vector<jit_fn_t>>(decoded.size(), nullptr);
+      jit.decoded = &decoded;
+      jit.entries = entries;
+      jit.compiled = 0;
+      jit.fallback = 0;
+
+      jit_emitter_t emitter;
+      std::vector<std::pair<size_t, size_t>> offsets;   // индекс инструкции, смещение кода
+
+      for (const auto& [name, address] : functions) {
+        if (is_label(name))
+          continue;
+        size_t index = text_index(decoded, address);
+        size_t offset = emitter.code.size();
+        if (jit_translate(emitter, decoded, index)) {
+          offsets.emplace_back(index, offset);
+          ++jit.compiled;
+        } else {
+          emitter.code.resize(offset);
+          ++jit.fallback;
+        }
+      }
+
+      if (emitter.code.empty())
+        return;
+
+      size_t size = emitter.code.size();
+      void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (addr == MAP_FAILED)
+        throw fatal_error("can not allocate jit buffer");
+      jit.storage = std::shared_ptr<const void>(addr, [size](const void* p) { munmap(const_cast<void*>(p), size); });
+
+      memcpy(addr, emitter.code.data(), size);
+      if (mprotect(addr, size, PROT_READ | PROT_EXEC))
+        throw fatal_error("can not protect jit buffer");
+
+      for (auto [index, offset] : offsets)
+        (*entries)[index] = reinterpret_cast<jit_fn_t>(static_cast<uint8_t*>(addr) + offset);
+    }
+
+    // Текущий фрейм исполняется через jit_frame. После выхода из-под контроля JIT
+    // исполнение продолжается с текущего состояния VM: фрейм с середины функции
+    // дорабатывает интерпретатор, вызовы из него снова идут в машинный код.
+    void run_jit(vm_t& vm, jit_t& jit) {
+      jit.error = nullptr;
+      while (!vm.halted && vm.steps < vm.limit) {
+        jit.nesting = 0;
+        jit_frame(jit, vm);
+        if (jit.error)
+          std::rethrow_exception(jit.error);
+      }
+    }
+#endif
+
+    // threaded, jit и block проверяют предел не на каждой инструкции и могут уйти
+    // за budget, поэтому ловушка считает шагами сам budget: одинаково на любом исполнителе.
+    [[noreturn]] void budget_trap(vm_t& vm, uint64_t budget) {
+      if (budget)
+        vm.steps = std::min(vm.steps, budget);
+      throw trap_error("step budget exceeded");
+    }
+
+    // Исполнение до HALT: YIELD только возвращает управление сюда, исчерпанный
+    // options.budget - ловушка. verified - текст принят верификатором (см. run_unchecked).
+    // Трассировку и профиль n-грамм пишет только table, с ними выбирается он.
+    void run(vm_t& vm, const decoded_text_t& decoded, const functions_t& functions, const options_t& options,
+        bool verified = false) {
+      auto engine = options.writer || options.profile ? engine_t::table : options.engine;
+#if defined(__x86_64__)
+      jit_t jit;
+      if (engine == engine_t::jit) {
+        jit_compile(jit, decoded, functions);
+        DEBUG_LOGGER_EXEC("jit: compiled %zu, fallback %zu", jit.compiled, jit.fallback);
+      }
+#endif
+      blocks_t blocks;
+      if (engine == engine_t::block) {
+        split_blocks(blocks, decoded, functions);
+        DEBUG_LOGGER_EXEC("blocks: %zu", blocks.blocks.size());
+      }
+
+      bool unchecked = options.unchecked && verified && !options.profile && !options.writer;
+
+      do {
+        vm.limit   = options.budget ? options.budget : steps_unlimited;
+        vm.yielded = false;
+        switch (engine) {
+          case engine_t::table:
+            if (unchecked)
+              run_unchecked(vm, decoded);
+            else
+              run_table(vm, decoded, options.trace, options.profile, options.writer);
+            break;
+          case engine_t::threaded: run_threaded(vm, decoded);                                              break;
+#if defined(__x86_64__)
+          case engine_t::jit:      run_jit(vm, jit);                                                       break;
+#else
+          case engine_t::jit:      run_threaded(vm, decoded);                                              break;
+#endif
+          case engine_t::block:    run_block(vm, decoded, blocks);                                         break;
+        }
+      } while (vm.yielded && !vm.halted);
+
+      // дошедший до RET после предела исполнитель тоже получает ловушку
+      if (!vm.halted || (options.budget && vm.steps > options.budget))
+        budget_trap(vm, options.budget);
+    }
+
+    void process(const decoded_text_t& decoded, const functions_t& functions, const options_t& options = {}) {
+      DEBUG_LOGGER_TRACE_EXEC;
+
+      auto verdict = semantic_analyzer_n::verify(decoded, functions);
+      DEBUG_LOGGER_EXEC("verifier: '%s'", semantic_analyzer_n::print_verdict(verdict).c_str());
+
+      vm_t vm;
+      init(vm, functions, options);
+
+      DEBUG_LOGGER_EXEC("engine: '%s'", engine_name(options.engine).c_str());
+      DEBUG_LOGGER_EXEC("stack frame: '%s'", print_stack(vm.stack, vm.registers_set).c_str());
+
+      if (options.profiler) {
+        vm.profiler = options.profiler;
+        vm.profiler->init(functions);
+        vm.profiler->enter((*vm.registers_set)[reg_ri], vm.steps);
+      }
+
+      run(vm, decoded, functions, options, verdict.verified);
+
+      if (vm.profiler)
+        vm.profiler->finish(vm.steps);
+
+      DEBUG_LOGGER_EXEC("steps: %lu", vm.steps);
+      DEBUG_LOGGER_EXEC("stack frame: '%s'", print_stack(vm.stack, vm.registers_set).c_str());
+    }
+
+    // Программа, подготовленная для пакетного исполнения: декодированный текст,
+    // таблица функций, текст threaded и машинный код JIT. После make_image только
+    // читается и разделяется всеми заданиями и воркерами.
+    struct image_t {
+      decoded_text_t  decoded;
+      functions_t     functions;
+      bool            unchecked = false;   // options.unchecked и текст принят верификатором
+      threaded_code_t threaded;
+      blocks_t        blocks;
+#if defined(__x86_64__)
+      jit_t          jit;
+#endif
+    };
+
+    std::shared_ptr<const image_t> make_image(const code_generator_n::program_t& program, const options_t& options = {}) {
+      auto image = std::make_shared<image_t>();
+      decoder_n::process(image->decoded, program.text, program.data);
+      image->unchecked = semantic_analyzer_n::verify(image->decoded, program.functions).verified && options.unchecked;
+      if (options.fuse)
+        decoder_n::fuse(image->decoded);
+      image->functions = program.functions;
+      if (options.engine == engine_t::threaded)
+        translate_threaded(image->threaded, image->decoded);
+      if (options.engine == engine_t::block)
+        split_blocks(image->blocks, image->decoded, image->functions);
+#if defined(__x86_64__)
+      if (options.engine == engine_t::jit)
+        jit_compile(image->jit, image->decoded, image->functions);
+#endif
+      return image;
+    }
+
+    // Снимок VM: открытая часть стека (копия в memfd), страницы памяти (общие,
+    // только для чтения), состояние исполнения и образ программы. fork запускает
+    // из снимка новую VM без копирования: стек - частное отображение memfd,
+    // страницы снимка - базовые страницы памяти. Новая VM тратит память только
+    // на то, что изменила.
+    struct snapshot_t {
+      std::shared_ptr<const image_t>                image;
+      stack_t::frozen_t                             stack;
+      std::shared_ptr<const memory_t::shared_map_t> pages;
+      uint64_t                                      memory_size;
+      reg_value_t                                   frame;   // смещение текущего фрейма в стеке
+      bool                                          halted;
+      uint64_t                                      steps;
+      size_t                                        depth;
+      size_t                                        max_depth;
+      const host_t*                                 host;
+    };
+
+    // Страницы памяти vm тоже становятся общими со снимком и копируются при записи.
+    std::shared_ptr<const snapshot_t> snapshot(vm_t& vm, std::shared_ptr<const image_t> image) {
+      reg_value_t frame = reinterpret_cast<uint8_t*>(vm.registers_set) - vm.stack.data();
+      return std::make_shared<const snapshot_t>(snapshot_t {
+        std::move(image), vm.stack.freeze(), vm.memory.freeze(), vm.memory.size_limit(),
+        frame, vm.halted, vm.steps, vm.depth, vm.max_depth, vm.host,
+      });
+    }
+
+    // vm продолжает с того же места, что и VM, с которой снят снимок.
+    void fork(vm_t& vm, const snapshot_t& snapshot) {
+      vm.stack.fork(snapshot.stack);
+      vm.memory.init(&vm.stack, snapshot.memory_size, snapshot.pages);
+      vm.registers_set = vm.stack.frame(snapshot.frame);
+      vm.halted    = snapshot.halted;
+      vm.steps     = snapshot.steps;
+      vm.depth     = snapshot.depth;
+      vm.max_depth = snapshot.max_depth;
+      vm.host      = snapshot.host;
+      vm.limit     = steps_unlimited;
+      vm.yielded   = false;
+    }
+
+    enum class status_t {
+      halted,      // RET корневого фрейма
+      yielded,     // YIELD
+      preempted,   // исчерпан отрезок шагов
+    };
+
+    // Исполняет VM над образом выбранным движком. Копия jit_t с состоянием вызовов
+    // на стеке хоста своя у каждого runner_t, поэтому runner_t не делится между потоками.
+    class runner_t {
+     public:
+      explicit runner_t(engine_t engine_ = engine_t::table) : engine(engine_) { }
+
+      // Отрезок исполнения: не больше steps шагов, до HALT или YIELD. Слитые инструкции
+      // не прерываются, threaded и jit проверяют границу на CALL, RET и YIELD.
+      // Все состояние остается в vm, следующий отрезок продолжает с RI текущего фрейма.
+      status_t slice(vm_t& vm, const std::shared_ptr<const image_t>& image, uint64_t steps) {
+        vm.limit   = steps < steps_unlimited - vm.steps ? vm.steps + steps : steps_unlimited;
+        vm.yielded = false;
+        switch (engine) {
+          case engine_t::table:
+            if (image->unchecked)
+              run_unchecked(vm, image->decoded);
+            else
+              run_table(vm, image->decoded, false);
+            break;
+          case engine_t::threaded:
+            if (image->threaded.empty())
+              run_threaded(vm, image->decoded);
+            else
+              run_threaded(&vm, image->decoded, image->threaded);
+            break;
+          case engine_t::jit:
+#if defined(__x86_64__)
+            if (compiled != image) {
+              jit      = image->jit;
+              compiled = image;
+            }
+            run_jit(vm, jit);
+#else
+            run_threaded(vm, image->decoded);
+#endif
+            break;
+          case engine_t::block:
+            if (!image->blocks.blocks.empty()) {
+              run_block(vm, image->decoded, image->blocks);
+              break;
+            }
+            if (split != image) {
+              split_blocks(blocks, image->decoded, image->functions);
+              split = image;
+            }
+            run_block(vm, image->decoded, blocks);
+            break;
+        }
+        if (vm.halted)
+          return status_t::halted;
+        return vm.yielded ? status_t::yielded : status_t::preempted;
+      }
+
+      // До HALT, YIELD пропускается; больше budget шагов (0 - без ограничения) - ловушка.
+      void complete(vm_t& vm, const std::shared_ptr<const image_t>& image, uint64_t budget) {
+        while (slice(vm, image, budget ? budget - std::min(vm.steps, budget) : steps_unlimited) == status_t::yielded)
+          ;
+        if (!vm.halted || (budget && vm.steps > budget))
+          budget_trap(vm, budget);
+      }
+
+     private:
+      engine_t                       engine;
+      std::shared_ptr<const image_t> split;      // образ, для которого разбиты blocks
+      blocks_t                       blocks;
+#if defined(__x86_64__)
+      std::shared_ptr<const image_t> compiled;   // образ, для которого скопирован jit
+      jit_t                          jit;
+#endif
+    };
+
+    struct result_t {
+      uint64_t        steps = 0;
+      registers_set_t registers = {};   // корневой фрейм после завершения
+      std::string     trap;             // ловушка гостя, пусто при нормальном завершении
+    };
+
+    // Пул воркеров с собственными деками заданий. Задания раздаются по кругу,
+    // воркер берет свои с хвоста, а опустев, крадет с головы чужих деков.
+    // У каждого воркера своя VM: резерв стека и страницы памяти переиспользуются
+    // между заданиями. Ловушки гостя возвращаются в result_t, остальные ошибки -
+    // исключением из future. Деструктор дожидается всех отправленных заданий.
+    // Трассировка, профиль и профилировщик в пакете не поддерживаются.
+    class batch_t {
+     public:
+      explicit batch_t(const options_t& options_ = {}, size_t threads = std::thread::hardware_concurrency())
+        : options(options_), workers(std::max<size_t>(threads, 1)) {
+        options.trace    = false;
+        options.profile  = nullptr;
+        options.writer   = nullptr;
+        options.profiler = nullptr;
+        for (size_t i = 0; i < workers.size(); ++i)
+          workers[i].thread = std::thread([this, i] { work(i); });
+      }
+
+      batch_t(const batch_t&) = delete;
+      batch_t& operator=(const batch_t&) = delete;
+
+      ~batch_t() {
+        {
+          std::lock_guard lock(mutex);
+          stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers)
+          worker.thread.join();
+      }
+
+      size_t size() const {
+        return workers.size();
+      }
+
+      size_t stolen() const {
+        return steals.load(std::memory_order_relaxed);
+      }
+
+      std::future<result_t> submit(std::shared_ptr<const image_t> image, std::string_view entry = "__start") {
+        auto it = image->functions.find(entry);
+        if (it == image->functions.end())
+          throw fatal_error(std::string(entry) + " not exists");
+
+        return push({ std::move(image), static_cast<reg_value_t>(it->second), nullptr, {} });
+      }
+
+      // Задание продолжает снимок в VM воркера.
+      std::future<result_t> submit(std::shared_ptr<const snapshot_t> snapshot) {
+        auto image = snapshot->image;
+        return push({ std::move(image), 0, std::move(snapshot), {} });
+      }
+
+     private:
+      struct job_t {
+        std::shared_ptr<const image_t>    image;
+        reg_value_t                       entry;
+        std::shared_ptr<const snapshot_t> snapshot;
+        std::promise<result_t>            promise;
+      };
+
+      struct worker_t {
+        std::mutex          mutex;
+        std::deque<job_t>   jobs;
+        std::thread         thread;
+      };
+
+      std::future<result_t> push(job_t job) {
+        auto future = job.promise.get_future();
+
+        auto& worker = workers[next.fetch_add(1, std::memory_order_relaxed) % workers.size()];
+        {
+          std::lock_guard lock(worker.mutex);
+          worker.jobs.push_back(std::move(job));
+        }
+        {
+          std::lock_guard lock(mutex);
+          ++pending;
+        }
+        wake.notify_one();
+        return future;
+      }
+
+      std::optional<job_t> take(size_t index) {
+        {
+          auto& own = workers[index];
+          std::lock_guard lock(own.mutex);
+          if (!own.jobs.empty()) {
+            job_t job = std::move(own.jobs.back());
+            own.jobs.pop_back();
+            return job;
+          }
+        }
+        for (size_t i = 1; i < workers.size(); ++i) {
+          auto& victim = workers[(index + i) % workers.size()];
+          std::lock_guard lock(victim.mutex);
+          if (!victim.jobs.empty()) {
+            job_t job = std::move(victim.jobs.front());
+            victim.jobs.pop_front();
+            steals.fetch_add(1, std::memory_order_relaxed);
+            return job;
+          }
+        }
+        return std::nullopt;
+      }
+
+      void work(size_t index) {
+        vm_t vm;
+        runner_t runner(options.engine);
+        while (true) {
+          std::optional<job_t> job = take(index);
+          if (!job) {
+            std::unique_lock lock(mutex);
+            if (!pending) {
+              if (stopping)
+                return;
+              wake.wait(lock, [this] { return stopping || pending; });
+            } else {
+              // задание уже забирает другой воркер
+              lock.unlock();
+              std::this_thread::yield();
+            }
+            continue;
+          }
+          {
+            std::lock_guard lock(mutex);
+            --pending;
+          }
+
+          result_t result;
+          try {
+            if (job->snapshot)
+              fork(vm, *job->snapshot);
+            else
+              init(vm, job->entry, options);
+            runner.complete(vm, job->image, options.budget);
+            memcpy(result.registers, *vm.registers_set, sizeof(registers_set_t));
+          } catch (const trap_error& e) {
+            result.trap = e.what();
+          } catch (...) {
+            job->promise.set_exception(std::current_exception());
+            continue;
+          }
+          result.steps = vm.steps;
+          job->promise.set_value(std::move(result));
+        }
+      }
+
+      options_t               options;
+      std::vector<worker_t>   workers;
+      std::mutex              mutex;
+      std::condition_variable wake;
+      size_t                  pending  = 0;   // отправленные, но еще не взятые задания
+      bool                    stopping = false;
+      std::atomic<size_t>     next     = 0;
+      std::atomic<size_t>     steals   = 0;
+    };
+
+    // Кооперативное разделение одного потока хоста между многими VM. Готовые задачи
+    // обходятся по кругу, за ход задача получает quantum * priority шагов или отдает
+    // управление раньше по YIELD. Задача, исчерпавшая budget, завершается ловушкой.
+    // Стек и память у каждой VM свои, между ходами все состояние лежит в vm_t.
+    // Ошибки, кроме ловушек гостя, выходят из step, задача при этом снимается.
+    class scheduler_t {
+     public:
+      explicit scheduler_t(const options_t& options_ = {}, uint64_t quantum_ = 10000)
+        : options(options_), quantum(std::max<uint64_t>(quantum_, 1)), runner(options_.engine) { }
+
+      size_t spawn(std::shared_ptr<const image_t> image, std::string_view entry = "__start",
+          unsigned priority = 1, uint64_t budget = 0) {
+        auto it = image->functions.find(entry);
+        if (it == image->functions.end())
+          throw fatal_error(std::string(entry) + " not exists");
+
+        task_t task { results.size(), std::move(image), std::make_unique<vm_t>(), std::max(priority, 1u), budget };
+        init(*task.vm, static_cast<reg_value_t>(it->second), options);
+        results.emplace_back();
+        ready.push_back(std::move(task));
+        return results.size() - 1;
+      }
+
+      // Задача продолжает снимок; budget считает и шаги до снимка.
+      size_t spawn(const std::shared_ptr<const snapshot_t>& snapshot, unsigned priority = 1, uint64_t budget = 0) {
+        task_t task { results.size(), snapshot->image, std::make_unique<vm_t>(), std::max(priority, 1u), budget };
+        fork(*task.vm, *snapshot);
+        results.emplace_back();
+        ready.push_back(std::move(task));
+        return results.size() - 1;
+      }
+
+      // Один ход первой готовой задачи, false - готовых задач нет.
+      bool step() {
+        if (ready.empty())
+          return false;
+
+        task_t task = std::move(ready.front());
+        ready.pop_front();
+        ++switch_count;
+
+        auto& vm = *task.vm;
+        uint64_t steps = quantum * task.priority;
+        if (steps / task.priority != quantum)
+          steps = steps_unlimited;
+        if (task.budget)
+          steps = std::min(steps, task.budget - std::min(vm.steps, task.budget));
+
+        result_t result;
+        try {
+          if (runner.slice(vm, task.image, steps) != status_t::halted) {
+            if (!task.budget || vm.steps < task.budget) {
+              ready.push_back(std::move(task));
+              return true;
+            }
+            budget_trap(vm, task.budget);
+          }
+          if (task.budget && vm.steps > task.budget)
+            budget_trap(vm, task.budget);
+          memcpy(result.registers, *vm.registers_set, sizeof(registers_set_t));
+        } catch (const trap_error& e) {
+          result.trap = e.what();
+        }
+        result.steps = vm.steps;
+        results[task.id] = std::move(result);
+        return true;
+      }
+
+      void run() {
+        while (step())
+          ;
+      }
+
+      bool done(size_t id) const {
+        return results.at(id).has_value();
+      }
+
+      const result_t& result(size_t id) const {
+        return results.at(id).value();
+      }
+
+      size_t active() const {
+        return ready.size();
+      }
+
+      size_t switches() const {
+        return switch_count;
+      }
+
+     private:
+      struct task_t {
+        size_t                         id;
+        std::shared_ptr<const image_t> image;
+        std::unique_ptr<vm_t>          vm;
+        unsigned                       priority;
+        uint64_t                       budget;
+      };
+
+      options_t                            options;
+      uint64_t                             quantum;
+      runner_t                             runner;
+      std::deque<task_t>                   ready;
+      std::vector<std::optional<result_t>> results;
+      size_t                               switch_count = 0;
+    };
+  }
+}
+
+
+struct interpreter_t {
+
+  struct fatal_error : std::runtime_error {
+    fatal_error(const std::string& msg = "unknown error") : std::runtime_error(msg) { }
+  };
+
+  risc_n::code_optimizer_n::options_t optimizer_options;
+  risc_n::code_optimizer_n::stats_t   optimizer_stats;
+  risc_n::compile_cache_n::cache_t*   cache = nullptr;
+  bool                                streaming = false;   // лексер, парсер и генератор в конвейере потоков
+  risc_n::pipeline_n::options_t       pipeline_options;
+  risc_n::utils_n::thread_pool_t*     pool = nullptr;      // секции функций собираются параллельно
+  risc_n::executor_n::host_t          host;                // HCALL/HBATCH, если в options.host не задано другое
+
+  interpreter_t() {
+    host.bind(risc_n::executor_n::host_call_write, risc_n::executor_n::host_write);
+  }
+
+  // При попадании в cache сборка пропускается целиком, optimizer_stats не меняется.
+  void compile(risc_n::code_generator_n::program_t& program, const std::string& code) {
+    using namespace risc_n;
+
+    uint64_t key = 0;
+    if (cache) {
+      key = compile_cache_n::content_hash(code, optimizer_options);
+      if (cache->find(program, key, code.size()))
+        return;
+    }
+
+    intermediate_code_generator_n::instructions_t instructions;
+    intermediate_code_generator_n::functions_t functions;
+    intermediate_code_generator_n::relocations_t relocations;
+    intermediate_code_generator_n::constants_t constants;
+
+    if (streaming) {
+      pipeline_n::process(instructions, functions, relocations, constants, code, pipeline_options);
+    } else {
+      lexical_analyzer_n::lexemes_t lexemes;
+      lexical_analyzer_n::process(lexemes, code);
+
+      syntax_analyzer_n::cmds_t cmds;
+      syntax_analyzer_n::process(cmds, lexemes);
+
+      intermediate_code_generator_n::process(instructions, functions, relocations, constants, cmds, pool);
+    }
+
+    code_optimizer_n::process(instructions, functions, relocations, constants, optimizer_stats, optimizer_options);
+
+    code_generator_n::process(program, instructions, functions, constants);
+
+    if (cache)
+      cache->insert(key, code.size(), program);
+  }
+
+  void exec(const risc_n::code_generator_n::program_t& program, const risc_n::executor_n::options_t& options = {}) {
+    using namespace risc_n;
+
+    decoder_n::decoded_text_t decoded;
+    decoder_n::process(decoded, program.text, program.data);
+    if (options.fuse)
+      decoder_n::fuse(decoded);
+
+    auto with_host = options;
+    if (!with_host.host)
+      with_host.host = &host;
+    executor_n::process(decoded, program.functions, with_host);
+  }
+
+  void exec(const std::string& code, const risc_n::executor_n::options_t& options = {}) {
+    risc_n::code_generator_n::program_t program;
+    compile(program, code);
+    exec(program, options);
+  }
+
+  // Объектный файл загружается без повторной сборки, исходник собирается.
+  void load_file(risc_n::code_generator_n::program_t& program, const std::string& path) {
+    if (risc_n::object_file_n::is_object_file(path)) {
+      risc_n::object_file_n::load(program, path);
+    } else {
+      compile(program, read_file(path));
+    }
+  }
+
+  void exec_file(const std::string& path, const risc_n::executor_n::options_t& options = {}) {
+    risc_n::code_generator_n::program_t program;
+    load_file(program, path);
+    exec(program, options);
+  }
+
+  risc_n::semantic_analyzer_n::verdict_t verify_file(const std::string& path) {
+    risc_n::code_generator_n::program_t program;
+    load_file(program, path);
+    risc_n::decoder_n::decoded_text_t decoded;
+    risc_n::decoder_n::process(decoded, program.text, program.data);
+    return risc_n::semantic_analyzer_n::verify(decoded, program.functions);
+  }
+
+  static std::string read_file(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+      throw fatal_error("can not open '" + path + "'");
+    std::stringstream ss;
+    ss << in.rdbuf();
+    return ss.str();
+  }
+};
+
+
+
+namespace benchmark_n {
+
+  using namespace risc_n;
+
+  // Программа без ветвлений: functions функций по block арифметических
+  // инструкций, __start вызывает каждую из них calls раз.
+  std::string generate_program(size_t functions, size_t block, size_t calls) {
+    static const std::vector<std::string> ops = { "ADD", "XOR", "MULT", "SUB", "OR", "AND" };
+
+    std::stringstream ss;
+    for (size_t f = 0; f < functions; ++f) {
+      ss << "FUNCTION f" << f << "\n";
+      ss << "  SET R1 " << (f + 3) << "\n";
+      ss << "  SET R2 " << (f + 5) << "\n";
+      for (size_t i = 0; i < block; ++i) {
+        ss << "  " << ops[i % ops.size()] << " R" << (i % 8 + 1)
+          << " R" << ((i + 1) % 8 + 1) << " R" << ((i + 2) % 8 + 1) << "\n";
+      }
+      ss << "RET\n";
+    }
+
+    ss << "FUNCTION __start\n";
+    for (size_t c = 0; c < calls; ++c) {
+      for (size_t f = 0; f < functions; ++f) {
+        ss << "  ADDRESS RA f" << f << "\n";
+        ss << "  CALL RA\n";
+      }
+    }
+    ss << "RET\n";
+
+    return ss.str();
+  }
+
+  // Цикл на метке: iterations итераций по body арифметических команд и условный BR.
+  std::string generate_loop(size_t iterations, size_t body) {
+    std::stringstream ss;
+    ss << "FUNCTION __start\n";
+    ss << "  SET R1 " << iterations << "\n";
+    ss << "  SET R2 1\n";
+    ss << "  ADDRESS R3 loop\n";
+    ss << "  LABEL loop\n";
+    for (size_t i = 0; i < body; ++i)
+      ss << "  " << (i % 2 ? "XOR" : "ADD") << " R" << (i % 4 + 4) << " R" << (i % 4 + 4) << " R1\n";
+    ss << "  SUB R1 R1 R2\n";
+    ss << "  BR R3 R1\n";
+    ss << "  ADD R8 R4 R5\n";
+    ss << "  ADD R8 R8 R6\n";
+    ss << "  ADD R8 R8 R7\n";
+    ss << "RET\n";
+    return ss.str();
+  }
+
+  // Обход памяти: каждая из functions функций читает, накапливает и пишет обратно
+  // block слов с шагом stride байт в своей области данных.
+  std::string generate_memory(size_t functions, size_t block, size_t stride, size_t calls) {
+    std::stringstream ss;
+    for (size_t f = 0; f < functions; ++f) {
+      ss << "FUNCTION f" << f << "\n";
+      ss << "  SET R1 " << (0x10000000 + f * block * stride) << "\n";
+      ss << "  SET R2 " << stride << "\n";
+      for (size_t i = 0; i < block; ++i) {
+        ss << "  LOAD R3 R1\n";
+        ss << "  ADD R4 R4 R3\n";
+        ss << "  SAVE R4 R1\n";
+        ss << "  ADD R1 R1 R2\n";
+      }
+      ss << "RET\n";
+    }
+
+    ss << "FUNCTION __start\n";
+    for (size_t c = 0; c < calls; ++c) {
+      for (size_t f = 0; f < functions; ++f) {
+        ss << "  ADDRESS RA f" << f << "\n";
+        ss << "  CALL RA\n";
+      }
+    }
+    ss << "RET\n";
+
+    return ss.str();
+  }
+
+  // Короткие листовые функции, которые main (не корневая) вызывает в цикле на iterations
+  // итераций: каждая добавляет свое число к своему слову данных.
+  std::string generate_leaves(size_t functions, size_t iterations) {
+    std::stringstream ss;
+    for (size_t f = 0; f < functions; ++f) {
+      ss << "FUNCTION f" << f << "\n";
+      ss << "  SET R2 " << (0x10000000 + f * 8) << "\n";
+      ss << "  LOAD R1 R2\n";
+      ss << "  SET R3 " << (f + 1) << "\n";
+      ss << "  ADD R1 R1 R3\n";
+      ss << "  SAVE R1 R2\n";
+      ss << "RET\n";
+    }
+
+    ss << "FUNCTION main\n";
+    ss << "  SET R4 " << iterations << "\n";
+    ss << "  SET R5 1\n";
+    ss << "  ADDRESS R6 loop\n";
+    ss << "  LABEL loop\n";
+    for (size_t f = 0; f < functions; ++f) {
+      ss << "  ADDRESS RA f" << f << "\n";
+      ss << "  CALL RA\n";
+    }
+    ss << "  SUB R4 R4 R5\n";
+    ss << "  BR R6 R4\n";
+    ss << "RET\n";
+
+    ss << "FUNCTION __start\n";
+    ss << "  ADDRESS RA main\n";
+    ss << "  CALL RA\n";
+    ss << "  SET R2 " << 0x10000000 << "\n";
+    ss << "  LOAD R1 R2\n";
+    ss << "RET\n";
+
+    return ss.str();
+  }
+
+  // arith - длинные арифметические блоки, calls - короткие функции и много CALL/RET,
+  // memory - LOAD/SAVE по 16 страницам данных.
+  // Каждый исполнитель запускается без слияния инструкций и со слиянием.
+  void engines(size_t repeats) {
+    struct workload_t {
+      std::string name;
+      std::string code;
+    };
+
+    std::vector<workload_t> workloads = {
+      { "arith", generate_program(16, 256, 16) },
+      { "calls", generate_program(64, 4, 64) },
+      { "memory", generate_memory(16, 64, 64, 16) },
+      { "loop", generate_loop(4096, 8) },
+    };
+
+    for (const auto& workload : workloads) {
+      interpreter_t interpreter;
+      code_generator_n::program_t program;
+      interpreter.compile(program, workload.code);
+
+      decoder_n::decoded_text_t plain;
+      decoder_n::process(plain, program.text, program.data);
+      decoder_n::decoded_text_t fused = plain;
+      decoder_n::fuse(fused);
+
+      for (bool fuse : { false, true })
+      for (auto engine : { executor_n::engine_t::table, executor_n::engine_t::threaded, executor_n::engine_t::jit,
+                           executor_n::engine_t::block }) {
+        const auto& decoded = fuse ? fused : plain;
+        executor_n::options_t options;
+        options.engine = engine;
+        options.trace  = false;
+
+#if defined(__x86_64__)
+        // JIT компилирует один раз, как и в реальной нагрузке с повторными вызовами.
+        executor_n::jit_t jit;
+        if (engine == executor_n::engine_t::jit)
+          executor_n::jit_compile(jit, decoded, program.functions);
+#endif
+        executor_n::blocks_t blocks;
+        if (engine == executor_n::engine_t::block)
+          executor_n::split_blocks(blocks, decoded, program.functions);
+
+        uint64_t steps = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t r = 0; r < repeats; ++r) {
+          executor_n::vm_t vm;
+          executor_n::init(vm, program.functions);
+#if defined(__x86_64__)
+          if (engine == executor_n::engine_t::jit)
+            executor_n::run_jit(vm, jit);
+          else
+#endif
+          if (engine == executor_n::engine_t::block)
+            executor_n::run_block(vm, decoded, blocks);
+          else
+            executor_n::run(vm, decoded, program.functions, options);
+          steps += vm.steps;
+        }
+        std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+
+        std::cout << "program: " << workload.name
+          << "  engine: " << std::setw(10) << std::left << executor_n::engine_name(engine) << std::right
+          << "  fuse: " << (fuse ? "on " : "off")
+          << "  instructions: " << steps
+          << "  time: " << std::fixed << std::setprecision(3) << duration.count() << "s"
+          << "  MIPS: " << std::setprecision(1) << steps / duration.count() / 1e6 << std::endl;
+      }
+    }
+  }
+
+  // Встраивание листовых функций: одна программа с --inline 0 и с порогом по умолчанию.
+  void inlining(size_t repeats) {
+    auto code = generate_leaves(8, 1024);
+
+    for (size_t limit : { size_t(0), code_optimizer_n::options_t{}.inline_limit }) {
+      interpreter_t interpreter;
+      interpreter.optimizer_options.inline_limit = limit;
+      code_generator_n::program_t program;
+      interpreter.compile(program, code);
+
+      decoder_n::decoded_text_t decoded;
+      decoder_n::process(decoded, program.text, program.data);
+
+      for (auto engine : { executor_n::engine_t::table, executor_n::engine_t::threaded, executor_n::engine_t::block }) {
+        executor_n::options_t options;
+        options.engine = engine;
+        options.trace  = false;
+
+        uint64_t steps = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t r = 0; r < repeats; ++r) {
+          executor_n::vm_t vm;
+          executor_n::init(vm, program.functions);
+          executor_n::run(vm, decoded, program.functions, options);
+          steps += vm.steps;
+        }
+        std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+
+        std::cout << "inline: " << std::setw(2) << limit
+          << "  engine: " << std::setw(10) << std::left << executor_n::engine_name(engine) << std::right
+          << "  inlined: " << interpreter.optimizer_stats.inlined
+          << "  instructions: " << steps
+          << "  time: " << std::fixed << std::setprecision(3) << duration.count() << "s"
+          << "  MIPS: " << std::setprecision(1) << steps / duration.count() / 1e6 << std::endl;
+      }
+    }
+  }
+
+  // table с проверкой RI на каждой инструкции и без нее (программа принята верификатором).
+  void unchecked(size_t repeats) {
+    struct workload_t {
+      std::string name;
+      std::string code;
+    };
+
+    std::vector<workload_t> workloads = {
+      { "arith", generate_program(16, 256, 16) },
+      { "calls", generate_program(64, 4, 64) },
+      { "loop", generate_loop(4096, 8) },
+    };
+
+    for (const auto& workload : workloads) {
+      interpreter_t interpreter;
+      code_generator_n::program_t program;
+      interpreter.compile(program, workload.code);
+
+      decoder_n::decoded_text_t decoded;
+      decoder_n::process(decoded, program.text, program.data);
+      auto verdict = semantic_analyzer_n::verify(decoded, program.functions);
+      decoder_n::fuse(decoded);
+
+      for (bool unchecked : { false, true }) {
+        executor_n::options_t options;
+        options.trace     = false;
+        options.unchecked = unchecked;
+
+        uint64_t steps = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t r = 0; r < repeats; ++r) {
+          executor_n::vm_t vm;
+          executor_n::init(vm, program.functions);
+          executor_n::run(vm, decoded, program.functions, options, verdict.verified);
+          steps += vm.steps;
+        }
+        std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+
+        std::cout << "program: " << std::setw(5) << std::left << workload.name << std::right
+          << "  unchecked: " << (unchecked ? "on " : "off")
+          << "  instructions: " << steps
+          << "  time: " << std::fixed << std::setprecision(3) << duration.count() << "s"
+          << "  MIPS: " << std::setprecision(1) << steps / duration.count() / 1e6 << std::endl;
+      }
+    }
+  }
+
+  // calls вызовов хоста 1 с аргументами 3 и 4: по одному HCALL в цикле или пакетами
+  // по batch записей HBATCH, собранными один раз по адресу 1 << 30.
+  std::string generate_host_calls(size_t calls, size_t batch) {
+    std::stringstream ss;
+    ss << "FUNCTION __start\n";
+    ss << "  SET R1 3\n";
+    ss << "  SET R2 4\n";
+    ss << "  SET RA 1\n";
+    ss << "  SET R6 1\n";
+    if (batch) {
+      ss << "  SET R4 " << (1ull << 30) << "\n";
+      ss << "  MOV R3 R4\n";
+      ss << "  SET R7 8\n";
+      ss << "  SET R8 48\n";
+      for (size_t i = 0; i < batch; ++i) {
+        ss << "  SAVE RA R3\n  ADD R3 R3 R7\n";
+        ss << "  SAVE R1 R3\n  ADD R3 R3 R7\n";
+        ss << "  SAVE R2 R3\n  ADD R3 R3 R8\n";
+      }
+      ss << "  SET R8 0\n";
+    }
+    ss << "  SET R5 " << (batch ? calls / batch : calls) << "\n";
+    ss << "  ADDRESS R7 loop\n";
+    ss << "  LABEL loop\n";
+    if (batch)
+      ss << "  HBATCH R3 R4\n";
+    else
+      ss << "  HCALL R3 RA\n";
+    ss << "  ADD R8 R8 R3\n";
+    ss << "  SUB R5 R5 R6\n";
+    ss << "  BR R7 R5\n";
+    ss << "RET\n";
+    return ss.str();
+  }
+
+  // Стоимость вызова хоста: HCALL на каждый вызов против HBATCH по 64 записи.
+  void host_calls(size_t repeats) {
+    static constexpr size_t calls = 1 << 16;
+
+    executor_n::host_t host;
+    host.bind(1, [](executor_n::vm_t&, void*, const executor_n::reg_value_t* args) { return args[0] + args[1]; });
+
+    for (size_t batch : { 0, 8, 64 }) {
+      interpreter_t interpreter;
+      code_generator_n::program_t program;
+      interpreter.compile(program, generate_host_calls(calls, batch));
+
+      decoder_n::decoded_text_t decoded;
+      decoder_n::process(decoded, program.text, program.data);
+      decoder_n::fuse(decoded);
+
+      executor_n::options_t options;
+      options.trace = false;
+      options.host  = &host;
+
+      uint64_t steps = 0;
+      auto start = std::chrono::steady_clock::now();
+      for (size_t r = 0; r < repeats; ++r) {
+        executor_n::vm_t vm;
+        executor_n::init(vm, program.functions, options);
+        executor_n::run(vm, decoded, program.functions, options);
+        steps += vm.steps;
+      }
+      std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+
+      std::cout << "host: " << (batch ? "HBATCH " + std::to_string(batch) : std::string("HCALL"))
+        << "  calls: " << calls
+        << "  instructions: " << steps / repeats
+        << "  time: " << std::fixed << std::setprecision(3) << duration.count() << "s"
+        << "  ns/call: " << std::setprecision(1) << duration.count() / (calls * repeats) * 1e9 << std::endl;
+    }
+  }
+
+  // SET с 64-битными константами: count констант в одной функции,
+  // каждая складывается в R8, чтобы оптимизатор не удалил ее как мертвую.
+  std::string generate_constants(size_t count) {
+    std::stringstream ss;
+    ss << "FUNCTION __start\n";
+    uint64_t value = 0x9E3779B97F4A7C15ull;
+    for (size_t i = 0; i < count; ++i) {
+      value = value * 6364136223846793005ull + 1442695040888963407ull;
+      ss << "  SET R" << (i % 7 + 1) << " " << (value >> 1) << "\n";
+      ss << "  ADD R8 R8 R" << (i % 7 + 1) << "\n";
+    }
+    ss << "RET\n";
+    return ss.str();
+  }
+
+  // Цепочка вызовов глубины depth, __start проходит ее calls раз.
+  // Функции объявлены от самой глубокой, ADDRESS ссылается назад.
+  std::string generate_chain(size_t depth, size_t calls) {
+    std::stringstream ss;
+    for (size_t f = depth; f-- > 0; ) {
+      ss << "FUNCTION f" << f << "\n";
+      ss << "  ADD R1 R1 R2\n";
+      if (f + 1 < depth) {
+        ss << "  ADDRESS RA f" << (f + 1) << "\n";
+        ss << "  CALL RA\n";
+      }
+      ss << "RET\n";
+    }
+
+    ss << "FUNCTION __start\n";
+    ss << "  SET R2 1\n";
+    for (size_t c = 0; c < calls; ++c) {
+      ss << "  ADDRESS RA f0\n";
+      ss << "  CALL RA\n";
+    }
+    ss << "RET\n";
+    return ss.str();
+  }
+
+  // Время одного прогона fn: минимум по повторам, повторы идут, пока не наберется 50 мс.
+  template <typename fn_t>
+  double measure(fn_t&& fn) {
+    double best = std::numeric_limits<double>::max();
+    double total = 0;
+    for (size_t r = 0; r < 3 || (total < 0.05 && r < 1000); ++r) {
+      auto start = std::chrono::steady_clock::now();
+      fn();
+      std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+      best = std::min(best, duration.count());
+      total += duration.count();
+    }
+    return best;
+  }
+
+  // Каждый этап конвейера отдельно на сгенерированных программах разного размера.
+  // Результат - JSON в stdout. Собирать с -DDEBUG_LOGGER_LEVEL=0, иначе меряются логи.
+  void stages() {
+    struct workload_t {
+      std::string name;
+      size_t      size;
+      std::string code;
+    };
+
+    std::vector<workload_t> workloads;
+    for (size_t size : { 256, 4096, 32768 })
+      workloads.push_back({ "constants", size, generate_constants(size) });
+    for (size_t size : { 16, 128, 384 })
+      workloads.push_back({ "chain", size, generate_chain(size, 64) });
+    for (size_t size : { 64, 512, 4096 })
+      workloads.push_back({ "arith", size, generate_program(16, size, 4) });
+    for (size_t size : { 64, 1024, 8192 })
+      workloads.push_back({ "functions", size, generate_program(size, 8, 1) });
+
+    std::cout << "{" << std::endl;
+    std::cout << "  \"logger_level\": " << DEBUG_LOGGER_LEVEL << "," << std::endl;
+    std::cout << "  \"results\": [";
+
+    bool first = true;
+    auto report = [&](const workload_t& workload, std::string_view stage, std::string_view unit, uint64_t items, double seconds) {
+      std::cout << (first ? "" : ",") << std::endl << "    { "
+        << "\"workload\": \"" << workload.name << "\", "
+        << "\"size\": " << workload.size << ", "
+        << "\"stage\": \"" << stage << "\", "
+        << "\"unit\": \"" << unit << "\", "
+        << "\"items\": " << items << ", "
+        << "\"seconds\": " << std::scientific << std::setprecision(6) << seconds << ", "
+        << "\"items_per_second\": " << items / seconds << " }" << std::defaultfloat;
+      first = false;
+    };
+
+    for (const auto& workload : workloads) {
+      lexical_analyzer_n::lexemes_t lexemes;
+      report(workload, "lex", "bytes", workload.code.size(), measure([&] {
+        lexemes.clear();
+        lexical_analyzer_n::process(lexemes, workload.code);
+      }));
+
+      syntax_analyzer_n::cmds_t cmds;
+      report(workload, "parse", "lexemes", lexemes.size(), measure([&] {
+        cmds.clear();
+        syntax_analyzer_n::process(cmds, lexemes);
+      }));
+
+      intermediate_code_generator_n::instructions_t instructions;
+      intermediate_code_generator_n::functions_t functions;
+      intermediate_code_generator_n::relocations_t relocations;
+      intermediate_code_generator_n::constants_t constants;
+      report(workload, "icg", "cmds", cmds.size(), measure([&] {
+        instructions.clear();
+        functions.clear();
+        relocations.clear();
+        constants.clear();
+        intermediate_code_generator_n::process(instructions, functions, relocations, constants, cmds);
+      }));
+
+      auto optimized = instructions;
+      auto optimized_functions = functions;
+      auto optimized_relocations = relocations;
+      auto optimized_constants = constants;
+      report(workload, "opt", "instructions", instructions.size(), measure([&] {
+        optimized = instructions;
+        optimized_functions = functions;
+        optimized_relocations = relocations;
+        optimized_constants = constants;
+        code_optimizer_n::stats_t stats;
+        code_optimizer_n::process(optimized, optimized_functions, optimized_relocations, optimized_constants, stats, {});
+      }));
+
+      code_generator_n::program_t program;
+      report(workload, "cg", "instructions", optimized.size(), measure([&] {
+        program = {};
+        code_generator_n::process(program, optimized, optimized_functions, optimized_constants);
+      }));
+
+      decoder_n::decoded_text_t decoded;
+      report(workload, "decode", "instructions", optimized.size(), measure([&] {
+        decoder_n::process(decoded, program.text, program.data);
+        decoder_n::fuse(decoded);
+      }));
+
+      auto exec = [&](executor_n::engine_t engine, auto&& run) {
+        uint64_t steps = 0;
+        double seconds = measure([&] {
+          executor_n::vm_t vm;
+          executor_n::init(vm, program.functions);
+          run(vm);
+          steps = vm.steps;
+        });
+        report(workload, "exec." + executor_n::engine_name(engine), "guest_instructions", steps, seconds);
+      };
+
+      for (auto engine : { executor_n::engine_t::table, executor_n::engine_t::threaded }) {
+        executor_n::options_t options;
+        options.engine = engine;
+        options.trace  = false;
+        exec(engine, [&](executor_n::vm_t& vm) { executor_n::run(vm, decoded, program.functions, options); });
+      }
+
+#if defined(__x86_64__)
+      // Компиляция JIT меряется отдельно от исполнения уже скомпилированного кода.
+      executor_n::jit_t jit;
+      report(workload, "jit", "instructions", decoded.size(), measure([&] {
+        executor_n::jit_compile(jit, decoded, program.functions);
+      }));
+      exec(executor_n::engine_t::jit, [&](executor_n::vm_t& vm) { executor_n::run_jit(vm, jit); });
+#endif
+    }
+
+    std::cout << std::endl << "  ]" << std::endl << "}" << std::endl;
+  }
+
+  // Стоимость бинарной трассировки табличного исполнителя.
+  void trace(size_t repeats) {
+    interpreter_t interpreter;
+    code_generator_n::program_t program;
+    interpreter.compile(program, generate_program(16, 256, 16));
+
+    decoder_n::decoded_text_t decoded;
+    decoder_n::process(decoded, program.text, program.data);
+
+    std::string path = "/tmp/risc_bench.trace";
+    for (bool enabled : { false, true }) {
+      std::unique_ptr<executor_n::trace_writer_t> writer;
+      if (enabled)
+        writer = std::make_unique<executor_n::trace_writer_t>(path);
+
+      executor_n::options_t options;
+      options.trace  = false;
+      options.writer = writer.get();
+
+      uint64_t steps = 0;
+      auto start = std::chrono::steady_clock::now();
+      for (size_t r = 0; r < repeats; ++r) {
+        executor_n::vm_t vm;
+        executor_n::init(vm, program.functions);
+        executor_n::run(vm, decoded, program.functions, options);
+        steps += vm.steps;
+      }
+      writer.reset();
+      std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+
+      std::cout << "trace: " << (enabled ? "on " : "off")
+        << "  instructions: " << steps
+        << "  time: " << std::fixed << std::setprecision(3) << duration.count() << "s"
+        << "  MIPS: " << std::setprecision(1) << steps / duration.count() / 1e6 << std::endl;
+    }
+    unlink(path.c_str());
+  }
+
+  // Восемь разных программ по кругу через interpreter_t::exec: без кэша, с кэшем,
+  // вмещающим все, с кэшем на 4 программы (LRU вытесняет каждую до повтора)
+  // и с кэшем на одну программу в памяти и каталогом на диске.
+  void cache(size_t repeats) {
+    std::vector<std::string> codes;
+    for (size_t i = 0; i < 8; ++i)
+      codes.push_back(generate_program(16 + i, 64, 2));
+
+    std::string dir = "/tmp/risc_bench.cache";
+    struct mode_t {
+      std::string name;
+      size_t      capacity;
+      bool        disk;
+    };
+
+    for (const auto& mode : std::vector<mode_t>{ { "off", 0, false }, { "memory-16", 16, false },
+        { "memory-4", 4, false }, { "disk", 1, true } }) {
+      std::unique_ptr<compile_cache_n::cache_t> cache;
+      if (mode.capacity)
+        cache = std::make_unique<compile_cache_n::cache_t>(mode.capacity, mode.disk ? dir : "");
+
+      interpreter_t interpreter;
+      interpreter.cache = cache.get();
+      executor_n::options_t options;
+      options.trace = false;
+
+      auto start = std::chrono::steady_clock::now();
+      for (size_t r = 0; r < repeats; ++r) {
+        for (const auto& code : codes)
+          interpreter.exec(code, options);
+      }
+      std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+
+      std::cout << "cache: " << std::setw(10) << std::left << mode.name << std::right
+        << "  execs: " << repeats * codes.size()
+        << "  time: " << std::fixed << std::setprecision(3) << duration.count() << "s"
+        << "  us/exec: " << std::setprecision(1) << duration.count() / (repeats * codes.size()) * 1e6;
+      if (cache) {
+        const auto& stats = cache->stats();
+        std::cout << "  hits: " << stats.hits << "  disk: " << stats.disk_hits
+          << "  misses: " << stats.misses << "  evictions: " << stats.evictions;
+      }
+      std::cout << std::endl;
+    }
+
+    for (const auto& code : codes) {
+      char name[64];
+      snprintf(name, sizeof(name), "/%016lx-%zu.rx", compile_cache_n::content_hash(code, {}), code.size());
+      unlink((dir + name).c_str());
+    }
+    rmdir(dir.c_str());
+  }
+
+  // Лексер, парсер и генерация промежуточного кода: последовательно и конвейером потоков.
+  // buffers - память под промежуточные лексемы и команды (векторы или очереди).
+  void pipeline(size_t repeats) {
+    std::cout << "pipeline: hardware threads: " << std::thread::hardware_concurrency() << std::endl;
+    for (size_t functions : { 2048, 16384 }) {
+      std::string code = generate_program(functions, 64, 1);
+
+      for (bool streaming : { true, false }) {
+        size_t instructions_count = 0;
+        size_t buffers = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t r = 0; r < repeats; ++r) {
+          intermediate_code_generator_n::instructions_t instructions;
+          intermediate_code_generator_n::functions_t functions;
+          intermediate_code_generator_n::relocations_t relocations;
+          intermediate_code_generator_n::constants_t constants;
+          if (streaming) {
+            pipeline_n::options_t options;
+            pipeline_n::process(instructions, functions, relocations, constants, code, options);
+            buffers = std::bit_ceil(options.queue)
+              * (sizeof(pipeline_n::chunk_t<lexical_analyzer_n::lexeme_t>) + sizeof(pipeline_n::chunk_t<syntax_analyzer_n::cmd_t>));
+          } else {
+            lexical_analyzer_n::lexemes_t lexemes;
+            lexical_analyzer_n::process(lexemes, code);
+            syntax_analyzer_n::cmds_t cmds;
+            syntax_analyzer_n::process(cmds, lexemes);
+            intermediate_code_generator_n::process(instructions, functions, relocations, constants, cmds);
+            buffers = lexemes.capacity() * sizeof(lexemes[0]) + cmds.capacity() * sizeof(cmds[0]);
+          }
+          instructions_count = instructions.size();
+        }
+        std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+
+        std::cout << "pipeline: " << (streaming ? "streaming " : "sequential")
+          << "  " << std::setw(10) << code.size() << " bytes"
+          << "  instructions: " << instructions_count
+          << "  time: " << std::fixed << std::setprecision(3) << duration.count() / repeats << "s"
+          << "  MB/s: " << std::setprecision(1) << code.size() * repeats / duration.count() / 1e6
+          << "  buffers: " << buffers / 1024 << " KB" << std::endl;
+      }
+    }
+  }
+
+  // Генерация промежуточного кода по секциям функций на пулах разного размера
+  // (лексемы и команды готовы заранее), функции ссылаются друг на друга вперед.
+  void sections(size_t repeats) {
+    std::stringstream ss;
+    for (size_t f = 0; f < 16384; ++f) {
+      ss << "FUNCTION f" << f << "\n";
+      for (size_t i = 0; i < 16; ++i)
+        ss << "  SET R" << (i % 8 + 1) << " " << (f * 16 + i) * 0x10001 << "\n";
+      ss << "  ADDRESS RA f" << (f + 1) % 16384 << "\n";
+      ss << "RET\n";
+    }
+    ss << "FUNCTION __start\nRET\n";
+    std::string code = ss.str();
+
+    lexical_analyzer_n::lexemes_t lexemes;
+    lexical_analyzer_n::process(lexemes, code);
+    syntax_analyzer_n::cmds_t cmds;
+    syntax_analyzer_n::process(cmds, lexemes);
+
+    size_t hardware = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<size_t> sizes = { 1, 2, 4 };
+    if (hardware > 4)
+      sizes.push_back(hardware);
+
+    for (size_t threads : sizes) {
+      utils_n::thread_pool_t pool(threads);
+      size_t instructions_count = 0;
+      auto start = std::chrono::steady_clock::now();
+      for (size_t r = 0; r < repeats; ++r) {
+        intermediate_code_generator_n::instructions_t instructions;
+        intermediate_code_generator_n::functions_t functions;
+        intermediate_code_generator_n::relocations_t relocations;
+        intermediate_code_generator_n::constants_t constants;
+        intermediate_code_generator_n::process(instructions, functions, relocations, constants, cmds, &pool);
+        instructions_count = instructions.size();
+      }
+      std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+
+      std::cout << "sections: threads: " << std::setw(3) << threads
+        << "  cmds: " << cmds.size()
+        << "  instructions: " << instructions_count
+        << "  time: " << std::fixed << std::setprecision(3) << duration.count() / repeats << "s"
+        << "  Mcmds/s: " << std::setprecision(1) << cmds.size() * repeats / duration.count() / 1e6 << std::endl;
+    }
+  }
+
+  // Пакет из count заданий на пулах разного размера. Легкие и тяжелые программы
+  // чередуются, поэтому при раздаче по кругу четному числу воркеров все тяжелые
+  // задания попадают к половине из них - остальным приходится красть.
+  void batch(size_t count) {
+    std::vector<std::shared_ptr<const executor_n::image_t>> images;
+    for (const auto& code : { generate_program(4, 16, 4), generate_program(16, 64, 16) }) {
+      interpreter_t interpreter;
+      code_generator_n::program_t program;
+      interpreter.compile(program, code);
+      executor_n::options_t options;
+      options.engine = executor_n::engine_t::threaded;
+      images.push_back(executor_n::make_image(program, options));
+    }
+
+    size_t hardware = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<size_t> sizes = { 1, 2, 4 };
+    if (hardware > 4)
+      sizes.push_back(hardware);
+
+    double base = 0;
+    for (size_t threads : sizes) {
+      executor_n::options_t options;
+      options.engine = executor_n::engine_t::threaded;
+      executor_n::batch_t batch(options, threads);
+
+      uint64_t steps = 0;
+      size_t traps = 0;
+      auto start = std::chrono::steady_clock::now();
+      std::vector<std::future<executor_n::result_t>> futures;
+      futures.reserve(count);
+      for (size_t i = 0; i < count; ++i)
+        futures.push_back(batch.submit(images[i % images.size()]));
+      for (auto& future : futures) {
+        auto result = future.get();
+        steps += result.steps;
+        traps += !result.trap.empty();
+      }
+      std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+
+      double rate = count / duration.count();
+      if (!base)
+        base = rate;
+      std::cout << "batch: threads: " << std::setw(3) << threads
+        << "  jobs: " << count
+        << "  traps: " << traps
+        << "  stolen: " << std::setw(6) << batch.stolen()
+        << "  time: " << std::fixed << std::setprecision(3) << duration.count() << "s"
+        << "  jobs/s: " << std::setprecision(0) << rate
+        << "  MIPS: " << std::setprecision(1) << steps / duration.count() / 1e6
+        << "  speedup: " << std::setprecision(2) << rate / base << std::endl;
+    }
+  }
+
+  // Одна длинная программа и count коротких за ней на одном потоке: без квантов
+  // короткие ждут завершения длинной, с квантами - один ход длинной.
+  // latency - время от запуска до завершения коротких программ.
+  void schedule(size_t count) {
+    std::vector<std::shared_ptr<const executor_n::image_t>> images;
+    for (const auto& code : { generate_program(64, 256, 256), generate_program(4, 16, 4) }) {
+      interpreter_t interpreter;
+      code_generator_n::program_t program;
+      interpreter.compile(program, code);
+      executor_n::options_t options;
+      options.engine = executor_n::engine_t::threaded;
+      images.push_back(executor_n::make_image(program, options));
+    }
+
+    for (uint64_t quantum : { executor_n::steps_unlimited, uint64_t(100000), uint64_t(10000), uint64_t(1000) }) {
+      executor_n::options_t options;
+      options.engine = executor_n::engine_t::threaded;
+      executor_n::scheduler_t scheduler(options, quantum);
+
+      scheduler.spawn(images[0]);
+      std::vector<size_t> pending;
+      for (size_t i = 0; i < count; ++i)
+        pending.push_back(scheduler.spawn(images[1]));
+
+      auto start = std::chrono::steady_clock::now();
+
+      std::vector<double> latencies;
+      while (scheduler.step()) {
+        auto finished = std::partition(pending.begin(), pending.end(), [&](size_t id) { return !scheduler.done(id); });
+        if (finished == pending.end())
+          continue;
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        latencies.insert(latencies.end(), static_cast<size_t>(pending.end() - finished), elapsed.count());
+        pending.erase(finished, pending.end());
+      }
+      std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+
+      std::sort(latencies.begin(), latencies.end());
+      std::cout << "schedule: quantum: " << std::setw(6)
+        << (quantum == executor_n::steps_unlimited ? std::string("none") : std::to_string(quantum))
+        << "  switches: " << std::setw(5) << scheduler.switches()
+        << "  time: " << std::fixed << std::setprecision(3) << duration.count() << "s"
+        << "  latency p50: " << std::setprecision(1) << latencies[latencies.size() / 2] * 1e6 << "us"
+        << "  max: " << latencies.back() * 1e6 << "us" << std::endl;
+    }
+  }
+
+  // Разогрев - 16 вызовов setup, каждый пишет 256 страниц данных, - затем YIELD
+  // и короткая работа, которая меняет одну страницу. cold: каждый экземпляр
+  // проходит разогрев сам, fork: продолжает снимок, снятый на YIELD.
+  // pages - собственные страницы данных экземпляра.
+  void fork(size_t count) {
+    std::stringstream ss;
+    ss << "FUNCTION setup\n  SET R1 0x10000000\n  SET R2 4096\n";
+    for (size_t i = 0; i < 256; ++i)
+      ss << "  SAVE R3 R1\n  ADD R1 R1 R2\n  ADD R3 R3 R2\n";
+    ss << "RET\n";
+    ss << "FUNCTION __start\n  SET R3 12345\n";
+    for (size_t i = 0; i < 16; ++i)
+      ss << "  ADDRESS RA setup\n  CALL RA\n";
+    ss << "  YIELD\n  SET R1 0x10000000\n  LOAD R2 R1\n  ADD R2 R2 R3\n  SAVE R2 R1\nRET\n";
+
+    interpreter_t interpreter;
+    code_generator_n::program_t program;
+    interpreter.compile(program, ss.str());
+    executor_n::options_t options;
+    options.engine = executor_n::engine_t::threaded;
+    auto image = executor_n::make_image(program, options);
+    executor_n::runner_t runner(options.engine);
+
+    executor_n::vm_t warm;
+    executor_n::init(warm, image->functions, options);
+    runner.slice(warm, image, executor_n::steps_unlimited);
+    auto snapshot = executor_n::snapshot(warm, image);
+
+    for (bool forked : { false, true }) {
+      uint64_t steps = 0;
+      size_t pages = 0;
+      auto start = std::chrono::steady_clock::now();
+      for (size_t i = 0; i < count; ++i) {
+        executor_n::vm_t vm;
+        if (forked)
+          executor_n::fork(vm, *snapshot);
+        else
+          executor_n::init(vm, image->functions, options);
+        runner.complete(vm, image, 0);
+        steps += vm.steps;
+        pages += vm.memory.pages_count();
+      }
+      std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+
+      std::cout << "fork: " << (forked ? "fork" : "cold")
+        << "  instances: " << count
+        << "  steps: " << steps / count
+        << "  time: " << std::fixed << std::setprecision(2) << duration.count() / count * 1e6 << "us"
+        << "  pages: " << pages / count << std::endl;
+    }
+  }
+
+  void lexer(size_t repeats) {
+    for (size_t functions : { 256, 2048, 16384 }) {
+      std::string code = generate_program(functions, 64, 1);
+
+      size_t lexemes = 0;
+      auto start = std::chrono::steady_clock::now();
+      for (size_t r = 0; r < repeats; ++r) {
+        lexical_analyzer_n::lexer_t lexer(code);
+        lexical_analyzer_n::lexeme_t lexeme;
+        while (lexer.next(lexeme))
+          ++lexemes;
+      }
+      std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+
+      std::cout << "lexer: " << std::setw(10) << code.size() << " bytes"
+        << "  lexemes: " << lexemes / repeats
+        << "  time: " << std::fixed << std::setprecision(3) << duration.count() / repeats << "s"
+        << "  MB/s: " << std::setprecision(1) << code.size() * repeats / duration.count() / 1e6 << std::endl;
+    }
+  }
+}
+
+// Проверка равносильности: каждая программа исполняется всеми исполнителями
+// (и table с --unchecked) при -O0/-O1 и со слиянием и без. При одном уровне оптимизации
+// совпадают ловушка, шаги и все регистры корневого фрейма, между уровнями - ловушка,
+// RA и R1..R8 (оптимизатор меняет число инструкций и RT). expect проверяет сами значения.
+namespace test_n {
+
+  using namespace risc_n;
+  using intermediate_code_generator_n::reg_index;
+  using intermediate_code_generator_n::reg_name;
+
+  struct case_t {
+    std::string                                    name;
+    std::string                                    code;
+    std::string                                    trap;     // пусто - программа доходит до RET
+    std::vector<std::pair<std::string, int64_t>>   expect;   // регистр и значение после RET
+    executor_n::options_t                          options = {};
+  };
+
+  struct outcome_t {
+    std::string                  trap;
+    uint64_t                     steps = 0;
+    executor_n::registers_set_t  registers = {};
+  };
+
+  std::string print_outcome(const outcome_t& outcome) {
+    std::stringstream ss;
+    ss << "steps " << outcome.steps;
+    if (!outcome.trap.empty())
+      ss << ", trap '" << outcome.trap << "'";
+    for (uint8_t r = 0; r < 16 && outcome.trap.empty(); ++r)
+      ss << ", " << reg_name(r) << " " << outcome.registers[r];
+    return ss.str();
+  }
+
+  std::vector<case_t> make_cases() {
+    std::vector<case_t> cases;
+
+    // R1 от 10 до 1, четные прибавляются дважды: 2 * 30 + 25
+    cases.push_back({ "branch", R"ASM(
+      FUNCTION __start
+        SET R1 10
+        SET R2 1
+        SET R8 0
+        ADDRESS R3 loop
+        ADDRESS R4 odd
+        LABEL loop
+        ADD R8 R8 R1
+        AND R5 R1 R2
+        BR R4 R5
+        ADD R8 R8 R1
+        LABEL odd
+        SUB R1 R1 R2
+        BR R3 R1
+      RET
+    )ASM", "", { { "R8", 85 }, { "R1", 0 } } });
+
+    // 8 байт через границу страницы вне стека и побайтное чтение обратно
+    cases.push_back({ "page boundary", R"ASM(
+      FUNCTION __start
+        SET R1 1073745916
+        SET R2 1234605616436508552
+        SAVE R2 R1
+        LOAD R3 R1
+        SET R4 4
+        ADD R5 R1 R4
+        LOAD8 R6 R5
+        LOAD32 R7 R5
+        SET R5 1073745919
+        LOAD16 R8 R5
+      RET
+    )ASM", "", { { "R3", 0x1122334455667788 }, { "R6", 0x44 }, { "R7", 0x11223344 }, { "R8", 0x4455 } } });
+
+    cases.push_back({ "constant pool", benchmark_n::generate_constants(300), "", {} });
+
+    // лист читает аргумент R1 из слота нового фрейма, результат - в память.
+    // В корневой функции живы все регистры, поэтому вызов идет из outer
+    cases.push_back({ "inline argument", R"ASM(
+      FUNCTION store
+        SET R2 1073741824
+        ADD R1 R1 R1
+        SAVE R1 R2
+      RET
+
+      FUNCTION outer
+        SET R4 64
+        ADD R5 RS R4
+        SET R6 21
+        SAVE R6 R5
+        ADDRESS RA store
+        CALL RA
+      RET
+
+      FUNCTION __start
+        ADDRESS RA outer
+        CALL RA
+        SET R7 1073741824
+        LOAD R8 R7
+      RET
+    )ASM", "", { { "R8", 42 } } });
+
+    // SAVE в слот RI своего фрейма - переход
+    cases.push_back({ "save RI", R"ASM(
+      FUNCTION __start
+        ADDRESS R1 skip
+        SET R2 128
+        SUB R2 RB R2
+        SAVE R1 R2
+        SET R3 1
+        SET R4 1
+        LABEL skip
+        SET R5 1
+      RET
+    )ASM", "", { { "R3", 0 }, { "R4", 0 }, { "R5", 1 } } });
+
+    cases.push_back({ "wrap", R"ASM(
+      FUNCTION __start
+        SET R1 1
+        SET R2 63
+        LSH R1 R1 R2
+        ADD R3 R1 R1
+        SET R4 70
+        SET R5 100
+        LSH R6 R5 R4
+        NOT R7 R3
+        RSH R8 R7 R4
+      RET
+    )ASM", "", { { "R3", 0 }, { "R6", 6400 }, { "R8", -1 } } });
+
+    const std::string recursion = R"ASM(
+      FUNCTION rec
+        ADDRESS RA rec
+        CALL RA
+      RET
+
+      FUNCTION __start
+        ADDRESS RA rec
+        CALL RA
+      RET
+    )ASM";
+
+    cases.push_back({ "depth", recursion, "max call depth exceeded", {} });
+    cases.back().options.max_depth = 100;
+
+    cases.push_back({ "stack", recursion, "stack overflow", {} });
+    cases.back().options.stack_size = 64 << 10;
+
+    cases.push_back({ "budget", benchmark_n::generate_loop(100, 4), "step budget exceeded", {} });
+    cases.back().options.budget = 250;
+
+    cases.push_back({ "memory fault", R"ASM(
+      FUNCTION __start
+        SET R1 1099511627776
+        SET R3 1
+        LOAD R2 R1
+        SET R4 1
+      RET
+    )ASM", "memory fault", {} });
+
+    cases.push_back({ "division", R"ASM(
+      FUNCTION __start
+        SET R1 7
+        SET R2 0
+        SET R3 1
+        DIV R4 R1 R2
+        SET R5 1
+      RET
+    )ASM", "division by zero", {} });
+
+    return cases;
+  }
+
+  outcome_t execute(const code_generator_n::program_t& program, const case_t& test, executor_n::engine_t engine,
+      bool fuse, bool unchecked) {
+    decoder_n::decoded_text_t decoded;
+    decoder_n::process(decoded, program.text, program.data);
+    auto verified = semantic_analyzer_n::verify(decoded, program.functions).verified;
+    if (fuse)
+      decoder_n::fuse(decoded);
+
+    auto options = test.options;
+    options.engine    = engine;
+    options.trace     = false;
+    options.fuse      = fuse;
+    options.unchecked = unchecked;
+
+    outcome_t outcome;
+    executor_n::vm_t vm;
+    try {
+      executor_n::init(vm, program.functions, options);
+      executor_n::run(vm, decoded, program.functions, options, verified);
+      memcpy(outcome.registers, *vm.registers_set, sizeof(executor_n::registers_set_t));
+    } catch (const executor_n::trap_error& e) {
+      outcome.trap = e.what();
+    }
+    outcome.steps = vm.steps;
+    return outcome;
+  }
+
+  // Число провалившихся программ.
+  size_t run() {
+    using executor_n::engine_t;
+
+    struct config_t {
+      engine_t engine;
+      bool     unchecked;
+    };
+
+    static const std::vector<config_t> configs = {
+      { engine_t::table, false }, { engine_t::table, true }, { engine_t::threaded, false },
+      { engine_t::jit, false },   { engine_t::block, false },
+    };
+
+    size_t failed = 0;
+    for (const auto& test : make_cases()) {
+      std::vector<std::string> errors;
+      std::optional<outcome_t> reference;   // -O0 table, регистры сравниваются со всеми
+      size_t runs = 0;
+
+      for (uint8_t level : { 0, 1 }) {
+        interpreter_t interpreter;
+        interpreter.optimizer_options.level = level;
+        code_generator_n::program_t program;
+        interpreter.compile(program, test.code);
+        if (test.name == "inline argument" && level && !interpreter.optimizer_stats.inlined)
+          errors.push_back("-O1: nothing inlined");
+
+        std::optional<outcome_t> first;   // шаги сравниваются внутри уровня
+        for (bool fuse : { false, true }) {
+          for (const auto& config : configs) {
+            auto outcome = execute(program, test, config.engine, fuse, config.unchecked);
+            ++runs;
+
+            std::string where = "-O" + std::to_string(level) + " " + executor_n::engine_name(config.engine)
+              + (config.unchecked ? " unchecked" : "") + (fuse ? " fuse" : " no-fuse");
+            if (!reference) {
+              reference = outcome;
+              if (outcome.trap != test.trap)
+                errors.push_back(where + ": expected trap '" + test.trap + "', got " + print_outcome(outcome));
+              for (const auto& [name, value] : test.expect) {
+                if (outcome.trap.empty() && outcome.registers[reg_index(name)] != value)
+                  errors.push_back(where + ": " + name + " = " + std::to_string(outcome.registers[reg_index(name)])
+                    + ", expected " + std::to_string(value));
+              }
+            }
+            if (!first)
+              first = outcome;
+
+            // внутри уровня совпадает все, между уровнями - ловушка, RA и R1..R8
+            bool level = outcome.trap == first->trap && outcome.steps == first->steps;
+            bool across = outcome.trap == reference->trap;
+            for (uint8_t r = 0; r < 16 && outcome.trap.empty(); ++r) {
+              level  &= outcome.registers[r] == first->registers[r];
+              across &= r < reg_index("RA") || outcome.registers[r] == reference->registers[r];
+            }
+            if (!level || !across)
+              errors.push_back(where + ": " + print_outcome(outcome) + "\n    expected: "
+                + print_outcome(level ? *reference : *first));
+          }
+        }
+      }
+
+      std::cout << "test: " << std::setw(16) << std::left << test.name << std::right
+        << "  runs: " << runs << "  " << (errors.empty() ? "ok" : "FAILED") << std::endl;
+      for (const auto& error : errors)
+        std::cout << "  " << error << std::endl;
+      failed += !errors.empty();
+    }
+    return failed;
+  }
+}
+
+// Таблица функций в stdout, collapsed stacks в файл.
+void write_callgraph(const std::string& path, const risc_n::executor_n::profiler_t& profiler) {
+  std::cout << risc_n::executor_n::print_profiler(profiler);
+  std::ofstream out(path, std::ios::trunc);
+  out << risc_n::executor_n::print_collapsed(profiler);
+  if (!out)
+    throw interpreter_t::fatal_error("can not write '" + path + "'");
+}
+
+int run_main(int argc, char* argv[]) {
+  interpreter_t interpreter;
+  risc_n::executor_n::options_t options;
+  risc_n::executor_n::profile_t profile;
+  std::unique_ptr<risc_n::executor_n::trace_writer_t> writer;
+  risc_n::executor_n::profiler_t profiler;
+  std::string callgraph;
+  std::unique_ptr<risc_n::compile_cache_n::cache_t> cache;
+  std::unique_ptr<risc_n::utils_n::thread_pool_t> pool;
+
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "test") {
+      return test_n::run() ? 1 : 0;
+    } else if (arg == "bench") {
+      std::string name = i + 1 < argc ? argv[++i] : "";
+      if (name.empty() || name == "engines")
+        benchmark_n::engines(200);
+      if (name.empty() || name == "inline")
+        benchmark_n::inlining(200);
+      if (name.empty() || name == "unchecked")
+        benchmark_n::unchecked(200);
+      if (name.empty() || name == "host")
+        benchmark_n::host_calls(50);
+      if (name.empty() || name == "lexer")
+        benchmark_n::lexer(5);
+      if (name.empty() || name == "trace")
+        benchmark_n::trace(50);
+      if (name.empty() || name == "cache")
+        benchmark_n::cache(50);
+      if (name.empty() || name == "pipeline")
+        benchmark_n::pipeline(3);
+      if (name.empty() || name == "sections")
+        benchmark_n::sections(5);
+      if (name.empty() || name == "batch")
+        benchmark_n::batch(20000);
+      if (name.empty() || name == "schedule")
+        benchmark_n::schedule(200);
+      if (name.empty() || name == "fork")
+        benchmark_n::fork(2000);
+      if (name == "stages")
+        benchmark_n::stages();
+      return 0;
+    } else if (arg == "-O0" || arg == "-O1") {
+      interpreter.optimizer_options.level = arg[2] - '0';
+    } else if (arg == "--inline" && i + 1 < argc) {
+      interpreter.optimizer_options.inline_limit = std::stoul(argv[++i]);
+    } else if (arg == "--engine" && i + 1 < argc) {
+      options.engine = risc_n::executor_n::engine_index(argv[++i]);
+    } else if (arg == "--max-depth" && i + 1 < argc) {
+      options.max_depth = std::stoul(argv[++i]);
+    } else if (arg == "--stack-size" && i + 1 < argc) {
+      options.stack_size = std::stoul(argv[++i]);
+    } else if (arg == "--memory-size" && i + 1 < argc) {
+      options.memory_size = std::stoull(argv[++i]);
+    } else if (arg == "--budget" && i + 1 < argc) {
+      options.budget = std::stoull(argv[++i]);
+    } else if (arg == "--cache-dir" && i + 1 < argc) {
+      cache = std::make_unique<risc_n::compile_cache_n::cache_t>(64, argv[++i]);
+      interpreter.cache = cache.get();
+    } else if (arg == "--threads" && i + 1 < argc) {
+      pool = std::make_unique<risc_n::utils_n::thread_pool_t>(std::stoul(argv[++i]));
+      interpreter.pool = pool.get();
+    } else if (arg == "--streaming") {
+      interpreter.streaming = true;
+    } else if (arg == "--no-fuse") {
+      options.fuse = false;
+    } else if (arg == "--unchecked") {
+      options.unchecked = true;
+    } else if (arg == "--trace" && i + 1 < argc) {
+      writer = std::make_unique<risc_n::executor_n::trace_writer_t>(argv[++i]);
+      options.engine = risc_n::executor_n::engine_t::table;
+      options.writer = writer.get();
+    } else if (arg == "trace-decode" && i + 1 < argc) {
+      risc_n::executor_n::print_trace(std::cout, argv[i + 1]);
+      return 0;
+    } else if (arg == "--callgraph" && i + 1 < argc) {
+      callgraph = argv[++i];
+      options.profiler = &profiler;
+    } else if (arg == "--profile") {
+      options.engine  = risc_n::executor_n::engine_t::table;
+      options.trace   = false;
+      options.profile = &profile;
+    } else if (arg == "compile" && i + 2 < argc) {
+      risc_n::code_generator_n::program_t program;
+      interpreter.compile(program, interpreter_t::read_file(argv[i + 1]));
+      risc_n::object_file_n::save(argv[i + 2], program);
+      return 0;
+    } else if (arg == "list" && i + 1 < argc) {
+      risc_n::code_generator_n::program_t program;
+      interpreter.compile(program, interpreter_t::read_file(argv[i + 1]));
+      std::cout << risc_n::code_generator_n::print_listing(program);
+      std::cerr << risc_n::code_optimizer_n::print_stats(interpreter.optimizer_stats);
+      return 0;
+    } else if (arg == "verify" && i + 1 < argc) {
+      std::cout << risc_n::semantic_analyzer_n::print_verdict(interpreter.verify_file(argv[i + 1]));
+      return 0;
+    } else if (arg == "run" && i + 1 < argc) {
+      interpreter.exec_file(argv[i + 1], options);
+      if (options.profile)
+        std::cout << risc_n::executor_n::print_profile(profile);
+      if (options.profiler)
+        write_callgraph(callgraph, profiler);
+      return 0;
+    } else {
+      std::cerr << "usage: " << argv[0] << " [-O0|-O1] [--inline <instructions>] [--engine table|threaded|jit|block] [--no-fuse] [--unchecked] [--max-depth <frames>] [--stack-size <bytes>] [--memory-size <bytes>] [--budget <steps>] [--cache-dir <dir>] [--streaming] [--threads <count>] [--profile] [--trace <file>] [--callgraph <file>]"
+        << " [test | bench [engines|inline|unchecked|host|lexer|trace|cache|pipeline|sections|batch|schedule|fork|stages] | compile <source> <object> | list <source> | verify <source|object> | run <source|object>"
+        << " | trace-decode <file>]" << std::endl;
+      return 1;
+    }
+  }
+
+  std::string code = R"ASM(
+    FUNCTION f1
+      MULT R1 R1 R2
+      MULT R4 R1 R5
+    RET
+
+    FUNCTION square
+      XOR R2 R3 R4
+    RET
+
+    FUNCTION main
+      SET R1 72623859790382856
+      MOV R2 R1
       MOV R3 R1
       MOV R4 R1
       ADDRESS RA square
@@ -663,9 +6914,26 @@ int main() {
   // std::cout << sizeof(interpreter_t::instruction_t) << std::endl;
   std::cout << code << std::endl;
 
-  interpreter_t interpreter;
-  interpreter.exec(code);
+  interpreter.exec(code, options);
+  if (options.profile)
+    std::cout << risc_n::executor_n::print_profile(profile);
+  if (options.profiler)
+    write_callgraph(callgraph, profiler);
 
   return 0;
 }
 
+// Ловушка гостя (стек, глубина вызовов, память, бюджет шагов) - код 2,
+// ошибка сборки, верификатора или окружения - код 1.
+int main(int argc, char* argv[]) {
+  try {
+    return run_main(argc, argv);
+  } catch (const risc_n::executor_n::trap_error& e) {
+    std::cerr << "trap: " << e.what() << std::endl;
+    return 2;
+  } catch (const std::exception& e) {
+    std::cerr << "error: " << e.what() << std::endl;
+    return 1;
+  }
+}
+